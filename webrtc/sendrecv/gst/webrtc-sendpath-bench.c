@@ -0,0 +1,319 @@
+/*
+ * Benchmark for the send path of webrtc-sendrecv: how many packets per second
+ * per core we can payload, encrypt and send.
+ *
+ * webrtcbin can't be driven without a peer, so this runs the same chain it
+ * uses on the way out, with pre-encoded H.264 so the encoder isn't measured:
+ *
+ *   appsrc ! rtph264pay ! srtpenc ! udpsink   (nicesink in webrtcbin)
+ *
+ * The chain is run three times, stopping after the payloader, after srtpenc
+ * and after udpsink, and the cost of each stage is the difference.
+ *
+ * Usage:
+ *   `./webrtc-sendpath-bench --loops 20`
+ *   `./webrtc-sendpath-bench --cipher aes-128-gcm --buffer-lists`
+ *
+ * --buffer-lists groups the packets of each frame into one buffer list, so
+ * srtpenc and udpsink get whole frames at once (udpsink sends lists with
+ * sendmmsg).
+ */
+#include <gst/gst.h>
+#include <gst/rtp/rtp.h>
+
+#include <string.h>
+#include <time.h>
+
+#define INPUT_CAPS "video/x-raw, width=640, height=480, framerate=25/1"
+#define VIDEO_H264_CAPS "video/x-h264, profile=constrained-baseline, " \
+    "stream-format=byte-stream, alignment=au"
+
+/* 16 bytes of key and 14 of salt for AES-ICM, GCM only uses 12 of salt */
+#define SRTP_KEY_ICM "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d"
+#define SRTP_KEY_GCM "000102030405060708090a0b0c0d0e0f101112131415161718191a1b"
+
+enum Stage
+{
+  STAGE_PAYLOAD,
+  STAGE_SRTP,
+  STAGE_UDP,
+  N_STAGES
+};
+
+static const gchar *stage_names[] = { "payload", "+srtp", "+udp" };
+
+static gint frames = 250;
+static gint loops = 10;
+static gint bitrate = 800;
+static gint mtu = 1300;
+static const gchar *cipher = "aes-128-icm";
+static gboolean buffer_lists = FALSE;
+static const gchar *host = "127.0.0.1";
+static gint port = 9;
+
+static GOptionEntry entries[] = {
+  {"frames", 0, 0, G_OPTION_ARG_INT, &frames, "Frames to encode", "N"},
+  {"loops", 0, 0, G_OPTION_ARG_INT, &loops,
+      "Times to send the encoded frames", "N"},
+  {"bitrate", 0, 0, G_OPTION_ARG_INT, &bitrate, "Encoder bitrate", "KBPS"},
+  {"mtu", 0, 0, G_OPTION_ARG_INT, &mtu, "Payloader MTU", "BYTES"},
+  {"cipher", 0, 0, G_OPTION_ARG_STRING, &cipher,
+      "SRTP cipher: aes-128-icm (with HMAC-SHA1-80) or aes-128-gcm", "CIPHER"},
+  {"buffer-lists", 0, 0, G_OPTION_ARG_NONE, &buffer_lists,
+      "Push the packets of each frame as one buffer list", NULL},
+  {"host", 0, 0, G_OPTION_ARG_STRING, &host, "Where to send packets", "HOST"},
+  {"port", 0, 0, G_OPTION_ARG_INT, &port, "Where to send packets", "PORT"},
+  {NULL},
+};
+
+/* Packets seen by the last element of the chain */
+static guint64 packets_out = 0;
+/* Packets of the current frame, see batch_probe() */
+static GstBufferList *batch = NULL;
+
+static gdouble
+cpu_time (void)
+{
+  struct timespec ts;
+
+  /* All threads of the process, the pipeline runs in its own */
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Encode the test pattern once, so the runs below only measure sending */
+static GPtrArray *
+encode_frames (void)
+{
+  GstElement *pipeline, *sink;
+  GPtrArray *encoded = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gst_buffer_unref);
+  GstSample *sample;
+  gchar *desc;
+
+  desc = g_strdup_printf ("videotestsrc pattern=18 num-buffers=%d ! "
+      INPUT_CAPS " ! x264enc bitrate=%d speed-preset=ultrafast "
+      "tune=zerolatency threads=1 ! " VIDEO_H264_CAPS " ! "
+      "appsink name=sink sync=false", frames, bitrate);
+  pipeline = gst_parse_launch (desc, NULL);
+  g_free (desc);
+  g_assert_nonnull (pipeline);
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  for (;;) {
+    g_signal_emit_by_name (sink, "pull-sample", &sample);
+    if (!sample)
+      break;
+    g_ptr_array_add (encoded, gst_buffer_ref (gst_sample_get_buffer (sample)));
+    gst_sample_unref (sample);
+  }
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  return encoded;
+}
+
+static GstPadProbeReturn
+count_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+    packets_out += gst_buffer_list_length (GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+  else
+    packets_out++;
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+has_marker (GstBuffer * buffer)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gboolean marker;
+
+  if (!gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return FALSE;
+  marker = gst_rtp_buffer_get_marker (&rtp);
+  gst_rtp_buffer_unmap (&rtp);
+  return marker;
+}
+
+static gboolean
+add_to_batch (GstBuffer ** buffer, guint idx, gpointer user_data)
+{
+  gst_buffer_list_add (batch, gst_buffer_ref (*buffer));
+  return TRUE;
+}
+
+/* Hold back payloaded packets until the one with the marker bit, the last of
+ * the frame, and send them all downstream as one buffer list */
+static GstPadProbeReturn
+batch_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstBuffer *last;
+  GstPad *peer;
+  GstFlowReturn ret;
+
+  if (!batch)
+    batch = gst_buffer_list_new ();
+
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+    gst_buffer_list_foreach (list, add_to_batch, NULL);
+    gst_buffer_list_unref (list);
+  } else {
+    gst_buffer_list_add (batch, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+  GST_PAD_PROBE_INFO_DATA (info) = NULL;
+
+  last = gst_buffer_list_get (batch, gst_buffer_list_length (batch) - 1);
+  if (!has_marker (last))
+    return GST_PAD_PROBE_HANDLED;
+
+  peer = gst_pad_get_peer (pad);
+  ret = gst_pad_chain_list (peer, batch);
+  gst_object_unref (peer);
+  batch = NULL;
+
+  GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+  return GST_PAD_PROBE_HANDLED;
+}
+
+/* Send @encoded through the chain up to @stage, returns the CPU time used */
+static gdouble
+run_stage (GPtrArray * encoded, enum Stage stage)
+{
+  GstElement *pipeline, *src, *pay, *last;
+  GstBus *bus;
+  GstMessage *msg;
+  GstPad *pad;
+  GString *desc;
+  gdouble start;
+  guint i, j;
+
+  desc = g_string_new (NULL);
+  if (stage >= STAGE_SRTP) {
+    gboolean gcm = g_str_equal (cipher, "aes-128-gcm");
+    g_string_append_printf (desc, "srtpenc name=enc key=%s rtp-cipher=%s "
+        "rtp-auth=%s rtcp-cipher=%s rtcp-auth=%s ",
+        gcm ? SRTP_KEY_GCM : SRTP_KEY_ICM, cipher,
+        gcm ? "null" : "hmac-sha1-80", cipher, gcm ? "null" : "hmac-sha1-80");
+  }
+  g_string_append_printf (desc, "appsrc name=src format=time caps=\""
+      VIDEO_H264_CAPS "\" ! h264parse ! rtph264pay name=pay "
+      "config-interval=-1 aggregate-mode=zero-latency mtu=%d", mtu);
+  if (stage >= STAGE_SRTP)
+    g_string_append (desc, " ! enc.rtp_sink_0 enc.rtp_src_0");
+  if (stage >= STAGE_UDP)
+    g_string_append_printf (desc, " ! udpsink name=last host=%s port=%d "
+        "sync=false async=false", host, port);
+  else
+    g_string_append (desc, " ! fakesink name=last sync=false async=false");
+
+  pipeline = gst_parse_launch (desc->str, NULL);
+  g_string_free (desc, TRUE);
+  g_assert_nonnull (pipeline);
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  pay = gst_bin_get_by_name (GST_BIN (pipeline), "pay");
+  last = gst_bin_get_by_name (GST_BIN (pipeline), "last");
+
+  if (buffer_lists) {
+    pad = gst_element_get_static_pad (pay, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+        GST_PAD_PROBE_TYPE_BUFFER_LIST, batch_probe, NULL, NULL);
+    gst_object_unref (pad);
+  }
+  packets_out = 0;
+  pad = gst_element_get_static_pad (last, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, count_probe, NULL, NULL);
+  gst_object_unref (pad);
+
+  /* Queue everything up front, with fresh timestamps for each loop */
+  for (i = 0; i < (guint) loops; i++) {
+    for (j = 0; j < encoded->len; j++) {
+      GstBuffer *buffer = gst_buffer_copy (g_ptr_array_index (encoded, j));
+      GstFlowReturn ret;
+
+      GST_BUFFER_PTS (buffer) = GST_BUFFER_DTS (buffer) =
+          (i * encoded->len + j) * GST_SECOND / 25;
+      GST_BUFFER_DURATION (buffer) = GST_SECOND / 25;
+      g_signal_emit_by_name (src, "push-buffer", buffer, &ret);
+      gst_buffer_unref (buffer);
+    }
+  }
+  g_signal_emit_by_name (src, "end-of-stream", NULL);
+
+  start = cpu_time ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  bus = gst_element_get_bus (pipeline);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_ERROR) {
+    GError *error;
+
+    gst_message_parse_error (msg, &error, NULL);
+    gst_printerr ("%s: %s\n", stage_names[stage], error->message);
+    g_error_free (error);
+  }
+  start = cpu_time () - start;
+
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (src);
+  gst_object_unref (pay);
+  gst_object_unref (last);
+  gst_object_unref (pipeline);
+  g_clear_pointer (&batch, gst_buffer_list_unref);
+
+  return start;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GPtrArray *encoded;
+  gdouble cpu[N_STAGES];
+  guint64 packets = 0;
+  enum Stage stage;
+
+  context = g_option_context_new ("- webrtc send path benchmark");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    gst_printerr ("Error initializing: %s\n", error->message);
+    return -1;
+  }
+
+  if (!g_str_equal (cipher, "aes-128-icm")
+      && !g_str_equal (cipher, "aes-128-gcm")) {
+    gst_printerr ("Unknown cipher %s\n", cipher);
+    return -1;
+  }
+
+  gst_print ("Encoding %d frames...\n", frames);
+  encoded = encode_frames ();
+
+  gst_print ("Sending them %d times, cipher %s%s\n\n", loops, cipher,
+      buffer_lists ? ", one buffer list per frame" : "");
+  gst_print ("%-8s %10s %8s %12s %14s\n", "stage", "packets", "cpu s",
+      "packets/s", "us/packet");
+  for (stage = 0; stage < N_STAGES; stage++) {
+    cpu[stage] = run_stage (encoded, stage);
+    if (!packets)
+      packets = packets_out;
+    /* Each stage's own cost is what it adds to the previous one */
+    gst_print ("%-8s %10" G_GUINT64_FORMAT " %8.2f %12.0f %14.3f\n",
+        stage_names[stage], packets_out, cpu[stage], packets_out / cpu[stage],
+        (cpu[stage] - (stage ? cpu[stage - 1] : 0)) * 1e6 / packets_out);
+  }
+  gst_print ("\nWhole send path: %.0f packets/s per core\n",
+      packets / cpu[STAGE_UDP]);
+
+  g_ptr_array_unref (encoded);
+  return 0;
+}
@@ -38,11 +38,66 @@
  *   or if built using meson
  *   `./_builddir/webrtc/sendrecv/gst/webrtc-sendrecv`
  *
+ * Or let the browser connect straight to us, without the signalling server:
+ *   `./webrtc-sendrecv --listen-port=8443 --listen-cert=cert.pem --listen-key=key.pem`
+ *   and visit 127.0.0.1:8080/?signalling=wss://<host>:8443
+ *
+ * The same port also takes WHIP (we receive) and WHEP (we send) style offers,
+ * answered in one round trip with all our candidates:
+ *   `curl -X POST -H 'Content-Type: application/sdp' --data-binary @offer.sdp \
+ *      http://<host>:8443/whep`
+ *   and `curl -X DELETE http://<host>:8443/whep/session` to hang up
+ *
+ * A DTLS certificate can be given with --dtls-cert, an ECDSA one is much
+ * cheaper to handshake with than the RSA one dtlsdec generates. Replace the
+ * file to rotate it, new sessions pick it up:
+ *   `openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+ *      -days 30 -subj /CN=webrtc-sendrecv -keyout dtls.pem -out dtls.pem`
+ *
+ * Streaming threads are named after the session and their role, e.g.
+ * "s3-enc0" or "s3-net1", so they can be told apart in top -H or perf. On
+ * Linux the video encoder and network threads can be pinned to sets of CPUs,
+ * keeping them off each other's caches when running many sessions:
+ *   `./webrtc-sendrecv --encoder-cpus=2-7 --network-cpus=0-1`
+ * Compare the Encoder max and Session stats printed every few seconds with
+ * and without pinning, with as many sessions as there are CPUs or more.
+ *
+ * With many viewers of the test pattern, --pre-encoded-pattern encodes it
+ * once at startup and replays the same H.264 to every session, so showing
+ * it costs no encoding. --test-pattern-file replays an H.264 file instead.
+ *
+ * The FILE video source streams --media-file, an MP4 or MKV with H.264 video
+ * and optionally Opus audio, as it is: no decoding or encoding, just
+ * payloading. One reader paced by the file's timestamps feeds every
+ * session, and loops. Constrained baseline H.264 is what browsers take.
+ * Sessions start with the GOP so far, or its IDR when the GOP is long,
+ * rather than waiting for the next IDR.
+ *
+ * Each frame goes out as a burst of packets as soon as it's payloaded, an
+ * IDR as dozens of them. --pace spreads them out, see pace_packet(). The
+ * session stats count video bursts and the loss the browser reports, compare
+ * them with and without.
+ *
+ * The loopback source sends back what the browser sends us, through shared
+ * memory. By default the receiving sinks sync to the clock, so each frame
+ * waits out the pipeline latency (webrtcbin's jitterbuffer latency, 200 ms by
+ * default) before it's handed over, and videorate holds another frame on the
+ * way back. --low-latency-loopback hands frames over as they are decoded and
+ * leaves videorate out; the live shmsrc timestamps them with the running
+ * time they arrive at. The "loopback" session stats measure the time from
+ * the shmsink to our encoder's queue, compare them with and without.
+ *
  * Toggle streams on and off using the Browser UI
  *
  * Author: Dan Squires <mangodan2003@gmail.com>, Nirbheek Chauhan <nirbheek@centricular.com>
  *
  */
+#ifdef __linux__
+#define _GNU_SOURCE             /* pthread_setname_np(), CPU sets */
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <gst/gst.h>
 #include <gst/sdp/sdp.h>
 #include <gst/rtp/rtp.h>
@@ -54,7 +109,13 @@
 #include <libsoup/soup.h>
 #include <json-glib/json-glib.h>
 
+/* For --ice-address, webrtcbin's ICE agent is libnice's */
+#include <nice/agent.h>
+#include <nice/interfaces.h>
+
+#include <glib/gstdio.h>
 #include <string.h>
+#include <time.h>
 
 enum AppState
 {
@@ -81,13 +142,23 @@ enum AppVideoSource
 {
   VIDEO_SOURCE_INVALID,
   VIDEO_SOURCE_TEST_PATTERN,
-  VIDEO_SOURCE_LOOPBACK
+  VIDEO_SOURCE_LOOPBACK,
+  VIDEO_SOURCE_FILE
 };
 
 #define VIDEO_H264_CAPS "video/x-h264, profile=constrained-baseline"
 #define INPUT_CAPS "video/x-raw, width=640, height=480, framerate=25/1"
 #define RTP_VIDEO_H264_CAPS "application/x-rtp,media=video,encoding-name=H264,payload=96"
 #define RTP_AUDIO_OPUS_CAPS "application/x-rtp,media=audio,encoding-name=OPUS,payload=97"
+/* x264enc bitrate, kbit/s */
+#define VIDEO_BITRATE 800
+
+#define STUN_SERVER "stun://stun.l.google.com:19302"
+/* See check_stun_server() */
+#define STUN_DEFAULT_PORT 3478
+#define STUN_MAGIC_COOKIE 0x2112A442
+#define STUN_CHECK_TIMEOUT (2 * G_USEC_PER_SEC)
+#define STUN_CHECK_RETRANSMIT (500 * G_TIME_SPAN_MILLISECOND)
 
 #define GST_CAT_DEFAULT webrtc_sendrecv_debug
 GST_DEBUG_CATEGORY_STATIC (GST_CAT_DEFAULT);
@@ -104,6 +175,200 @@ static gchar *our_id = "gst-peer";
 static const gchar *server_url = "wss://127.0.0.1:8443";
 static gboolean disable_ssl = FALSE;
 static gboolean making_offer = FALSE;
+/* Ask the server for compact framing at HELLO, see Protocol.md */
+static gboolean compact = FALSE;
+/* Whether the server accepted it */
+static gboolean compact_framing = FALSE;
+
+/* Embedded signalling server, see start_signalling_server() */
+static SoupServer *signalling_server = NULL;
+static gint listen_port = 0;
+static gchar *listen_cert = NULL, *listen_key = NULL;
+/* WHIP/WHEP offer waiting for our answer, see on_whip_request() */
+static SoupMessage *whip_msg = NULL;
+
+/* Compact framing envelope kinds */
+#define ENVELOPE_RELAY 1
+
+/* ICE configuration, see start_pipeline(), restrict_ice_addresses() and
+ * candidate_allowed() */
+static const gchar *stun_server = STUN_SERVER;
+static gchar *turn_server = NULL;
+static gboolean host_only = FALSE;
+static gchar **ice_addresses = NULL;
+static gint ice_min_port = 0, ice_max_port = 0;
+static gboolean ice_udp_only = FALSE;
+
+/* DTLS certificate and key from --dtls-cert, see get_dtls_pem() */
+static gchar *dtls_cert = NULL;
+static gchar *dtls_pem = NULL;
+static gint64 dtls_pem_mtime = 0;
+
+/* Push each video frame's RTP packets as one buffer list, see batch_probe() */
+static gboolean rtp_buffer_lists = FALSE;
+
+/* Spread video packets out instead of sending each frame as a burst, see
+ * pace_packet() */
+static gboolean pace_video = FALSE;
+/* The pacer's pending wait, unscheduled on flush and when video stops so
+ * the streaming thread isn't stuck in it, see pace_unschedule() */
+static GMutex pace_lock;
+static GstClockID pace_wait = NULL;
+static gboolean pace_flushing = FALSE;
+
+/* Run the cheap stages (video parsing and payloading, sending out of
+ * webrtcbin, received audio playout) in the thread of the stage before them
+ * instead of behind a queue of their own, see stage_queue() */
+static gboolean lightweight_streams = FALSE;
+
+/* The test pattern encoded once, an access unit per buffer starting with an
+ * IDR, and replayed to every session instead of encoding it for each. See
+ * load_test_pattern(). */
+static gboolean pre_encoded_pattern = FALSE;
+static gchar *test_pattern_file = NULL;
+static GPtrArray *pattern_frames = NULL;
+/* One GOP, 2 seconds at the framerate of INPUT_CAPS */
+#define PATTERN_FRAMES 50
+#define PATTERN_FRAME_DURATION (GST_SECOND / 25)
+
+/* --media-file: one reader for the process, whose H.264 and Opus every
+ * session gets as they are in the file, see on_media_file_sample() */
+static gchar *media_file = NULL;
+static GstElement *media_reader = NULL;
+static gboolean media_file_audio = FALSE;
+static GMutex media_file_lock;
+static GList *media_subscribers = NULL;
+/* The session's timeline: the reader's running time at the session's first
+ * buffer, and the session's running time then */
+static GstClockTime media_file_offset = GST_CLOCK_TIME_NONE;
+static GstClockTime media_file_base = GST_CLOCK_TIME_NONE;
+/* Video samples since the last IDR, to start new sessions with, see
+ * media_file_subscribe() */
+static GPtrArray *media_file_gop = NULL;
+/* More than this and we wait for the next IDR instead */
+#define MEDIA_FILE_GOP_MAX 300
+/* Between the cached frames we start a session with */
+#define GOP_PRIME_SPACING GST_MSECOND
+/* At most this many cached frames after the IDR are sent at once, 1 ms
+ * apart. With more, a session gets the IDR alone and then waits for the
+ * next one, rather than a burst of seconds of video. */
+#define GOP_PRIME_TAIL 8
+
+/* Don't sync the loopback's sinks to the clock, see the top of the file */
+static gboolean low_latency_loopback = FALSE;
+
+/* How the video payloader packetizes. The defaults come from the command
+ * line, and the browser can change them for its session with
+ * "SET <key> <value>" on the data channel, see apply_session_setting(). */
+struct SessionConfig
+{
+  gint mtu;
+  /* rtph264pay aggregate-mode: none, zero-latency or max */
+  gchar *aggregate_mode;
+  /* Seconds between SPS/PPS, -1 for with every IDR. When aggregating, they
+   * go out in a STAP-A with the IDR's first NAL rather than on their own. */
+  gint config_interval;
+  /* Lower the MTU when the selected ICE pair is relayed, see
+   * on_new_selected_pair() */
+  gboolean mtu_from_pair;
+  /* Rolling intra refresh instead of IDRs, see configure_rate_control() */
+  gboolean intra_refresh;
+};
+static struct SessionConfig default_config = { 1300, (gchar *) "zero-latency", -1, FALSE, FALSE };
+static struct SessionConfig session_config;
+
+/* CPU lists like "0-3,8" to pin streaming threads to, see
+ * on_stream_status() */
+static gchar *encoder_cpus = NULL, *network_cpus = NULL;
+#ifdef __linux__
+static cpu_set_t encoder_cpu_set, network_cpu_set, all_cpu_set;
+#endif
+/* Sessions started by this process, and streaming threads started in the
+ * current one, for naming threads */
+static guint session_count = 0;
+static gint session_threads = 0;
+
+/* TURN adds its ChannelData header and another UDP/IP header */
+#define RELAY_MTU_OVERHEAD 40
+
+/* Candidate type and transport by foundation, "L:" or "R:" + foundation for
+ * local and remote candidates, for telling what the selected pair is. Local
+ * ones come from webrtcbin's thread and the pair from libnice's. */
+static GHashTable *candidate_kinds = NULL;
+static GMutex candidate_kinds_lock;
+/* Whether the video MTU was already lowered for a relayed pair this session */
+static gboolean relay_mtu_lowered = FALSE;
+
+/* Buffers through one point of the pipeline. Pushes are buffers or buffer
+ * lists, frames are counted by RTP marker bits. */
+struct StreamCounters
+{
+  guint64 pushes, buffers, bytes, frames;
+};
+
+/* Timings and counters for the current session, reset by start_pipeline().
+ * Times are g_get_monotonic_time() values, 0 until the event happens. */
+struct SessionMetrics
+{
+  gint64 start;
+  gint64 gathering_start, gathering_done;
+  gint64 checking_start, ice_connected;
+  gint64 dtls_connected, first_media_in, first_media_out;
+  guint candidates_sent, candidates_dropped;
+  /* Distinct local ports we gathered on, i.e. the sockets this session uses */
+  guint local_ports[16], n_local_ports;
+  /* RTP handed to webrtcbin, and coming out of it */
+  struct StreamCounters video_out, audio_out, media_in;
+  /* Frames through x264enc, the time they spent in it in us, and the
+   * largest */
+  guint64 encoded_frames;
+  gint64 encode_time, encode_time_max;
+  gsize encoded_size_max;
+  /* Last frame into the loopback's shmsink, and frames back out of it into
+   * our encoder's queue with the time they took in us */
+  gint64 loopback_in;
+  guint64 loopback_frames;
+  gint64 loopback_time, loopback_time_max;
+  /* Video packets leaving for webrtcbin, see pace_packet(): runs of
+   * packets less than BURST_GAP apart, the longest, and the current one */
+  guint64 bursts;
+  guint burst_max, burst_len;
+  GstClockTime last_departure, pace_next;
+  /* The video's bitrate as paced, measured over PACE_RATE_WINDOW of PTS */
+  guint64 pace_rate, pace_window_bytes;
+  GstClockTime pace_window_start;
+  /* From webrtcbin's stats, all streams: what we sent, and what the
+   * browser's receiver reports say it lost of that */
+  guint64 packets_sent, remote_packets_lost;
+  /* From the pipeline bus, see on_bus_message() */
+  guint errors, warnings, qos_messages;
+  guint64 qos_dropped;
+  /* At the last print_session_stats() */
+  struct StreamCounters video_reported;
+  gdouble reported_cpu;
+};
+static struct SessionMetrics metrics;
+
+/* CPU time of the streaming threads that carried this session's buffers,
+ * sampled with CLOCK_THREAD_CPUTIME_ID from our pad probes, see
+ * sample_thread_cpu(). Keyed by GThread. */
+struct ThreadCpu
+{
+  gdouble first, last;
+};
+static GMutex thread_cpu_lock;
+static GHashTable *thread_cpu = NULL;
+
+/* Open data channel to the browser, for STATS and EVENT messages */
+static GObject *data_channel = NULL;
+
+/* Buffers dropped so far by each element posting QoS messages, by object
+ * path. The messages carry running totals, this gives us the increments. */
+static GHashTable *qos_dropped = NULL;
+
+/* Latency of each branch in ms, as last measured by measure_latency() */
+static JsonObject *branch_latency = NULL;
+static gint latency_update_pending = 0;
 
 static unsigned int ping_count = 0;
 
@@ -113,10 +378,76 @@ static GOptionEntry entries[] = {
   {"server", 0, 0, G_OPTION_ARG_STRING, &server_url,
       "Signalling server to connect to", "URL"},
   {"disable-ssl", 0, 0, G_OPTION_ARG_NONE, &disable_ssl, "Disable ssl", NULL},
+  {"compact", 0, 0, G_OPTION_ARG_NONE, &compact,
+      "Ask the server for compact (binary) framing of relayed messages", NULL},
+  {"listen-port", 0, 0, G_OPTION_ARG_INT, &listen_port,
+      "Accept browsers on this port instead of using a signalling server",
+      "PORT"},
+  {"listen-cert", 0, 0, G_OPTION_ARG_FILENAME, &listen_cert,
+      "TLS certificate (PEM) for --listen-port, plain ws:// without it", "FILE"},
+  {"listen-key", 0, 0, G_OPTION_ARG_FILENAME, &listen_key,
+      "TLS private key (PEM) for --listen-cert, if not in the same file",
+      "FILE"},
+  {"stun-server", 0, 0, G_OPTION_ARG_STRING, &stun_server,
+      "STUN server, empty for none (default: " STUN_SERVER ")", "URL"},
+  {"turn-server", 0, 0, G_OPTION_ARG_STRING, &turn_server,
+      "TURN server", "turn(s)://USER:PASSWORD@HOST:PORT"},
+  {"host-only", 0, 0, G_OPTION_ARG_NONE, &host_only,
+      "LAN mode: no STUN or TURN, only offer host candidates", NULL},
+  {"ice-address", 0, 0, G_OPTION_ARG_STRING_ARRAY, &ice_addresses,
+      "Only gather and offer candidates on addresses starting with this, can "
+      "be given several times", "PREFIX"},
+  {"ice-min-port", 0, 0, G_OPTION_ARG_INT, &ice_min_port,
+      "Lowest UDP port to gather candidates on", "PORT"},
+  {"ice-max-port", 0, 0, G_OPTION_ARG_INT, &ice_max_port,
+      "Highest UDP port to gather candidates on", "PORT"},
+  {"ice-udp-only", 0, 0, G_OPTION_ARG_NONE, &ice_udp_only,
+      "No ICE-TCP candidates, so each session only uses one UDP socket per "
+      "interface", NULL},
+  {"dtls-cert", 0, 0, G_OPTION_ARG_FILENAME, &dtls_cert,
+      "DTLS certificate and private key (PEM), reloaded when the file changes",
+      "FILE"},
+  {"rtp-buffer-lists", 0, 0, G_OPTION_ARG_NONE, &rtp_buffer_lists,
+      "Send the RTP packets of each video frame as one buffer list", NULL},
+  {"pre-encoded-pattern", 0, 0, G_OPTION_ARG_NONE, &pre_encoded_pattern,
+      "Encode the test pattern once at startup and replay it to every session",
+      NULL},
+  {"test-pattern-file", 0, 0, G_OPTION_ARG_FILENAME, &test_pattern_file,
+      "Replay this H.264 byte-stream as the test pattern, it must start with "
+      "an IDR", "FILE"},
+  {"media-file", 0, 0, G_OPTION_ARG_FILENAME, &media_file,
+      "H.264 (and Opus) file to stream as the FILE video source, in a loop, "
+      "without transcoding", "FILE"},
+  {"low-latency-loopback", 0, 0, G_OPTION_ARG_NONE, &low_latency_loopback,
+      "Show and loop back received video as it arrives, without clock sync",
+      NULL},
+  {"pace", 0, 0, G_OPTION_ARG_NONE, &pace_video,
+      "Pace video packets out, and give audio priority over video", NULL},
+  {"lightweight-streams", 0, 0, G_OPTION_ARG_NONE, &lightweight_streams,
+      "No queue threads in front of parsing, payloading, sending and audio "
+      "playout, fewer threads per session",
+      NULL},
+  {"mtu", 0, 0, G_OPTION_ARG_INT, &default_config.mtu,
+      "Video payloader MTU (default: 1300)", "BYTES"},
+  {"aggregate-mode", 0, 0, G_OPTION_ARG_STRING, &default_config.aggregate_mode,
+      "Video payloader NAL aggregation: none, zero-latency (default) or max",
+      "MODE"},
+  {"config-interval", 0, 0, G_OPTION_ARG_INT, &default_config.config_interval,
+      "Seconds between SPS/PPS, -1 (default) for with every IDR", "SECONDS"},
+  {"mtu-from-pair", 0, 0, G_OPTION_ARG_NONE, &default_config.mtu_from_pair,
+      "Lower the video MTU when the selected ICE pair is relayed", NULL},
+  {"intra-refresh", 0, 0, G_OPTION_ARG_NONE, &default_config.intra_refresh,
+      "Encode with rolling intra refresh and a one frame VBV, no IDR spikes",
+      NULL},
+  {"encoder-cpus", 0, 0, G_OPTION_ARG_STRING, &encoder_cpus,
+      "Pin video encoder threads to these CPUs (Linux only)", "LIST"},
+  {"network-cpus", 0, 0, G_OPTION_ARG_STRING, &network_cpus,
+      "Pin webrtcbin's streaming threads to these CPUs (Linux only)", "LIST"},
   {NULL},
 };
 
 static guint g_source_data_channel_ping_timeout = 0, g_source_stats_timeout = 0;
+static guint g_source_session_stats_timeout = 0, g_source_bus_watch = 0;
 
 static const char* video_source_to_string(enum AppVideoSource source) {
   switch(source) {
@@ -124,6 +455,8 @@ static const char* video_source_to_string(enum AppVideoSource source) {
     return "test pattern";
   case VIDEO_SOURCE_LOOPBACK:
     return "loopback";
+  case VIDEO_SOURCE_FILE:
+    return "file";
   default:
     return "Invalid";
   }
@@ -198,17 +531,293 @@ get_string_from_json_object (JsonObject * object)
   return text;
 }
 
+static void
+add_branch_latency (const gchar * branch, GstQuery * query)
+{
+  gboolean live;
+  GstClockTime min, max;
+
+  gst_query_parse_latency (query, &live, &min, &max);
+  json_object_set_double_member (branch_latency, branch, min / 1e6);
+  gst_print ("Latency of %s: %" GST_TIME_FORMAT " (%s)\n", branch,
+      GST_TIME_ARGS (min), live ? "live" : "not live");
+}
+
+static void
+query_element_latency (const gchar * branch, GstElement * element)
+{
+  GstQuery *query = gst_query_new_latency ();
+
+  if (gst_element_query (element, query))
+    add_branch_latency (branch, query);
+  gst_query_unref (query);
+}
+
+/* Our send bins have no sinks for a bin query to go to, so ask upstream of
+ * their src pad */
+static void
+query_bin_src_latency (const gchar * branch, GstElement * bin)
+{
+  GstPad *pad = gst_element_get_static_pad (bin, "src");
+  GstQuery *query = gst_query_new_latency ();
+
+  if (gst_pad_query (pad, query))
+    add_branch_latency (branch, query);
+  gst_query_unref (query);
+  gst_object_unref (pad);
+}
+
+/* Recompute the pipeline's latency and measure each branch's: upstream from
+ * our send bins' src pads, and from each receiving sink, which includes
+ * webrtcbin's jitterbuffer. */
+static gboolean
+measure_latency (void)
+{
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  GstElement *sink;
+
+  g_atomic_int_set (&latency_update_pending, 0);
+  if (!pipe1)
+    return G_SOURCE_REMOVE;
+
+  gst_bin_recalculate_latency (GST_BIN (pipe1));
+  if (branch_latency)
+    json_object_unref (branch_latency);
+  branch_latency = json_object_new ();
+
+  query_element_latency ("pipeline", pipe1);
+  if (video_bin)
+    query_bin_src_latency ("video_out", video_bin);
+  if (audio_bin)
+    query_bin_src_latency ("audio_out", audio_bin);
+
+  it = gst_bin_iterate_sinks (GST_BIN (pipe1));
+  while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+    sink = g_value_get_object (&item);
+    if (sink != webrtc1)
+      query_element_latency (GST_OBJECT_NAME (sink), sink);
+    g_value_reset (&item);
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+  return G_SOURCE_REMOVE;
+}
+
+/* After adding or removing a branch. Can be called from any thread. */
+static void
+schedule_latency_update (void)
+{
+  if (g_atomic_int_compare_and_exchange (&latency_update_pending, 0, 1))
+    g_idle_add ((GSourceFunc) measure_latency, NULL);
+}
+
+/* Frames are one at a time on the loopback, so the last one into the
+ * shmsink is the one coming back out */
+static GstPadProbeReturn
+loopback_in_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  metrics.loopback_in = g_get_monotonic_time ();
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+loopback_out_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  gint64 elapsed;
+
+  if (!metrics.loopback_in)
+    return GST_PAD_PROBE_OK;
+  elapsed = g_get_monotonic_time () - metrics.loopback_in;
+  metrics.loopback_frames++;
+  metrics.loopback_time += elapsed;
+  metrics.loopback_time_max = MAX (metrics.loopback_time_max, elapsed);
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+add_loopback_probe (GstElement * element, GstPadProbeCallback callback)
+{
+  GstPad *pad = gst_element_get_static_pad (element, "sink");
+
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, callback, NULL, NULL);
+  gst_object_unref (pad);
+}
+
+/* autovideosink only picks its sink when it starts */
+static void
+on_display_sink_added (GstBin * bin, GstElement * element, gpointer user_data)
+{
+  if (g_object_class_find_property (G_OBJECT_GET_CLASS (element), "sync"))
+    g_object_set (element, "sync", FALSE, NULL);
+}
+
+/* A queue, so a thread, in front of a cheap stage: video parsing and
+ * payloading after the encoder, webrtcbin's RTP/SRTP and the nicesink send
+ * after a payloader, and received audio playout after webrtcbin. These used
+ * to be the bulk of our threads, several per session. A shared fixed-size
+ * GstTaskPool can't take their place: a queue's task blocks waiting for
+ * data, so a few idle sessions would hold every pool thread and stall the
+ * rest. With --lightweight-streams this is an identity, so the bins keep the
+ * same shape, and the stage runs in the thread pushing into it. For sent
+ * audio that is audiotestsrc's, which already encoded and payloaded and now
+ * also packetises and sends. */
+static GstElement *
+stage_queue (void)
+{
+  return gst_element_factory_make (lightweight_streams ? "identity" : "queue",
+      NULL);
+}
+
+/* The elements of a receive branch, its decodebin and what
+ * handle_media_stream() puts after it, point at the decodebin. An error in
+ * any of them stops just that branch, see stop_receive_branch(). */
+#define RECV_BRANCH_KEY "recv-branch"
+
+static void
+mark_receive_branch (GstElement * decodebin, GstElement * element, ...)
+{
+  va_list args;
+
+  va_start (args, element);
+  for (; element; element = va_arg (args, GstElement *))
+    g_object_set_data (G_OBJECT (element), RECV_BRANCH_KEY, decodebin);
+  va_end (args);
+}
+
+/* The decodebin of the receive branch @src is in, or NULL */
+static GstElement *
+receive_branch_of (GstObject * src)
+{
+  GstObject *top = gst_object_ref (src), *parent;
+  GstElement *decodebin = NULL;
+
+  while ((parent = gst_object_get_parent (top))
+      && parent != GST_OBJECT (pipe1)) {
+    gst_object_unref (top);
+    top = parent;
+  }
+  if (parent) {
+    decodebin = g_object_get_data (G_OBJECT (top), RECV_BRANCH_KEY);
+    gst_object_unref (parent);
+  }
+  gst_object_unref (top);
+  return decodebin;
+}
+
+static gboolean
+forget_incoming_pad (GstElement * decodebin, GstPad * pad, gpointer user_data)
+{
+  if (incoming_video_pad_name == GST_PAD_NAME (pad))
+    incoming_video_pad_name = NULL;
+  if (incoming_audio_pad_name == GST_PAD_NAME (pad))
+    incoming_audio_pad_name = NULL;
+  return TRUE;
+}
+
+static gboolean
+remove_receive_branch (GstElement * decodebin)
+{
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
+  GstElement *element;
+  GList *branch = NULL, *l;
+
+  /* The session may have ended in the meantime */
+  if (!pipe1 || GST_OBJECT_PARENT (decodebin) != GST_OBJECT (pipe1)) {
+    gst_object_unref (decodebin);
+    return G_SOURCE_REMOVE;
+  }
+
+  gst_element_foreach_src_pad (decodebin, forget_incoming_pad, NULL);
+  it = gst_bin_iterate_elements (GST_BIN (pipe1));
+  while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+    element = g_value_get_object (&item);
+    if (g_object_get_data (G_OBJECT (element), RECV_BRANCH_KEY) == decodebin)
+      branch = g_list_prepend (branch, gst_object_ref (element));
+    g_value_reset (&item);
+  }
+  g_value_unset (&item);
+  gst_iterator_free (it);
+
+  for (l = branch; l; l = l->next) {
+    gst_element_set_state (l->data, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (pipe1), l->data);
+  }
+  g_list_free_full (branch, gst_object_unref);
+  gst_object_unref (decodebin);
+  schedule_latency_update ();
+  return G_SOURCE_REMOVE;
+}
+
+/* Called once webrtcbin isn't pushing into the branch. What it receives
+ * from now on goes to a fakesink, an unlinked pad would be an error that
+ * ends the session. */
+static GstPadProbeReturn
+divert_receive_branch (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GstElement *decodebin = user_data;
+  GstElement *fakesink = gst_element_factory_make ("fakesink", NULL);
+  GstPad *peer = gst_pad_get_peer (pad), *sinkpad;
+
+  if (peer) {
+    gst_pad_unlink (pad, peer);
+    gst_object_unref (peer);
+  }
+  g_object_set (fakesink, "sync", FALSE, "async", FALSE, NULL);
+  gst_bin_add (GST_BIN (pipe1), fakesink);
+  gst_element_sync_state_with_parent (fakesink);
+  sinkpad = gst_element_get_static_pad (fakesink, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+
+  g_idle_add ((GSourceFunc) remove_receive_branch, gst_object_ref (decodebin));
+  return GST_PAD_PROBE_REMOVE;
+}
+
+/* Stop playing out what the browser sends on one stream, after an error in
+ * its branch. The rest of the session goes on. */
+static void
+stop_receive_branch (GstElement * decodebin)
+{
+  GstPad *sinkpad, *pad;
+
+  /* Several of its elements can fail */
+  if (g_object_get_data (G_OBJECT (decodebin), "recv-stopping"))
+    return;
+  g_object_set_data (G_OBJECT (decodebin), "recv-stopping",
+      GINT_TO_POINTER (TRUE));
+
+  sinkpad = gst_element_get_static_pad (decodebin, "sink");
+  pad = gst_pad_get_peer (sinkpad);
+  if (pad) {
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_IDLE, divert_receive_branch,
+        gst_object_ref (decodebin), gst_object_unref);
+    gst_object_unref (pad);
+  } else {
+    g_idle_add ((GSourceFunc) remove_receive_branch,
+        gst_object_ref (decodebin));
+  }
+  gst_object_unref (sinkpad);
+}
+
 static void
 handle_media_stream (GstPad * pad, GstElement * pipe, const char *convert_name,
     const char *sink_name)
 {
   GstPad *qpad, *tee_pad1, *tee_pad2, *q1_pad, *q2_pad;
   GstElement *q1, *q2, *t, *conv, *resample, *sink1, *sink2;
+  GstElement *decodebin = gst_pad_get_parent_element (pad);
   GstPadLinkReturn ret;
 
   gst_println ("Trying to handle stream with %s ! %s", convert_name, sink_name);
 
-  q1 = gst_element_factory_make ("queue", NULL);
+  /* Audio is cheap enough to play out from webrtcbin's thread */
+  if (g_strcmp0 (convert_name, "audioconvert") == 0)
+    q1 = stage_queue ();
+  else
+    q1 = gst_element_factory_make ("queue", NULL);
   g_assert_nonnull (q1);
   conv = gst_element_factory_make (convert_name, NULL);
   g_assert_nonnull (conv);
@@ -221,6 +830,7 @@ handle_media_stream (GstPad * pad, GstElement * pipe, const char *convert_name,
     resample = gst_element_factory_make ("audioresample", NULL);
     g_assert_nonnull (resample);
     gst_bin_add_many (GST_BIN (pipe), q1, conv, resample, sink1, NULL);
+    mark_receive_branch (decodebin, q1, conv, resample, sink1, NULL);
     gst_element_sync_state_with_parent (q1);
     gst_element_sync_state_with_parent (conv);
     gst_element_sync_state_with_parent (resample);
@@ -236,7 +846,14 @@ handle_media_stream (GstPad * pad, GstElement * pipe, const char *convert_name,
     sink2 = gst_element_factory_make ("shmsink", NULL);
     g_assert_nonnull (sink2);
     g_object_set(sink2, "socket-path", "/tmp/gst-send-recv", "shm-size", 2000000, NULL);
+    add_loopback_probe (sink2, loopback_in_probe);
+    if (low_latency_loopback) {
+      g_object_set (sink2, "sync", FALSE, NULL);
+      g_signal_connect (sink1, "element-added",
+          G_CALLBACK (on_display_sink_added), NULL);
+    }
     gst_bin_add_many (GST_BIN (pipe), t, q1, conv, sink1, q2, sink2, NULL);
+    mark_receive_branch (decodebin, t, q1, conv, sink1, q2, sink2, NULL);
     gst_element_sync_state_with_parent (t);
     gst_element_sync_state_with_parent (q1);
     gst_element_sync_state_with_parent (q2);
@@ -267,6 +884,8 @@ handle_media_stream (GstPad * pad, GstElement * pipe, const char *convert_name,
 
   ret = gst_pad_link (pad, qpad);
   g_assert_cmphex (ret, ==, GST_PAD_LINK_OK);
+  gst_object_unref (decodebin);
+  schedule_latency_update ();
 }
 
 static void
@@ -297,6 +916,10 @@ on_incoming_decodebin_stream (GstElement * decodebin, GstPad * pad,
   }
 }
 
+static GstPadProbeReturn count_probe (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data);
+static void add_first_media_probe (GstPad * pad, gint64 * first);
+
 static void
 on_incoming_stream (GstElement * webrtc, GstPad * pad, GstElement * pipe)
 {
@@ -308,7 +931,10 @@ on_incoming_stream (GstElement * webrtc, GstPad * pad, GstElement * pipe)
   if (GST_PAD_DIRECTION (pad) != GST_PAD_SRC)
     return;
 
-
+  if (!metrics.first_media_in)
+    add_first_media_probe (pad, &metrics.first_media_in);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, count_probe, &metrics.media_in, NULL);
 
   GstWebRTCRTPTransceiver* transceiver;
   g_object_get(pad, "transceiver", &transceiver, NULL);
@@ -328,6 +954,7 @@ on_incoming_stream (GstElement * webrtc, GstPad * pad, GstElement * pipe)
 
 
   decodebin = gst_element_factory_make ("decodebin", NULL);
+  mark_receive_branch (decodebin, decodebin, NULL);
   g_signal_connect (decodebin, "pad-added",
       G_CALLBACK (on_incoming_decodebin_stream), pipe1);
   gst_bin_add (GST_BIN (pipe), decodebin);
@@ -369,6 +996,137 @@ on_stream_removed (GstElement * webrtc, GstPad * pad, GstElement * pipe)
   }
 }
 
+/* Relay @text to our session peer, in a binary envelope if the server agreed
+ * to compact framing */
+static void
+send_text_to_peer (const gchar * text)
+{
+  if (compact_framing) {
+    gsize len = strlen (text);
+    guint8 *frame = g_malloc (len + 2);
+
+    /* In a session the server knows who the message is for, so the peer id
+     * in the envelope is left empty */
+    frame[0] = ENVELOPE_RELAY;
+    frame[1] = 0;
+    memcpy (frame + 2, text, len);
+    soup_websocket_connection_send_binary (ws_conn, frame, len + 2);
+    g_free (frame);
+  } else {
+    soup_websocket_connection_send_text (ws_conn, text);
+  }
+}
+
+static gdouble
+metrics_ms (gint64 from, gint64 to)
+{
+  return (to - from) / 1000.0;
+}
+
+/* Remember which local port @candidate is on, for the per-session socket
+ * count printed once gathering is complete */
+static void
+metrics_add_local_port (const gchar * candidate)
+{
+  gchar **fields = g_strsplit (candidate, " ", -1);
+  guint i, port;
+
+  /* Only our own sockets, not the server reflexive/relayed addresses */
+  if (g_strv_length (fields) < 8 || g_strcmp0 (fields[7], "host") != 0)
+    goto out;
+
+  port = g_ascii_strtoull (fields[5], NULL, 10);
+  for (i = 0; i < metrics.n_local_ports; i++) {
+    if (metrics.local_ports[i] == port)
+      goto out;
+  }
+  if (metrics.n_local_ports < G_N_ELEMENTS (metrics.local_ports))
+    metrics.local_ports[metrics.n_local_ports++] = port;
+
+out:
+  g_strfreev (fields);
+}
+
+/* Remember @candidate's type and transport, @prefix is "L:" or "R:" */
+static void
+remember_candidate_kind (const gchar * prefix, const gchar * candidate)
+{
+  gchar **fields;
+
+  if (g_str_has_prefix (candidate, "a="))
+    candidate += 2;
+  fields = g_strsplit (candidate, " ", -1);
+  g_mutex_lock (&candidate_kinds_lock);
+  if (g_strv_length (fields) >= 8 && g_str_has_prefix (fields[0], "candidate:")
+      && candidate_kinds) {
+    g_hash_table_insert (candidate_kinds,
+        g_strconcat (prefix, fields[0] + strlen ("candidate:"), NULL),
+        g_strdup_printf ("%s/%s", fields[7], fields[2]));
+  }
+  g_mutex_unlock (&candidate_kinds_lock);
+  g_strfreev (fields);
+}
+
+/* Whether to tell the peer about @candidate, per --host-only and
+ * --ice-address. Host candidates are only gathered on the addresses given
+ * there already, see restrict_ice_addresses(), this drops the reflexive and
+ * relayed ones. Candidates look like
+ * "candidate:1 1 UDP 2015363327 192.168.1.2 40000 typ host ..." */
+static gboolean
+candidate_allowed (const gchar * candidate)
+{
+  gchar **fields = g_strsplit (candidate, " ", -1);
+  gboolean allowed = TRUE;
+  guint i;
+
+  if (g_strv_length (fields) < 8)
+    goto out;
+
+  if (host_only && g_strcmp0 (fields[7], "host") != 0)
+    allowed = FALSE;
+
+  if (allowed && ice_addresses) {
+    allowed = FALSE;
+    for (i = 0; ice_addresses[i]; i++) {
+      if (g_str_has_prefix (fields[4], ice_addresses[i]))
+        allowed = TRUE;
+    }
+  }
+
+out:
+  g_strfreev (fields);
+  return allowed;
+}
+
+/* Have libnice gather only on the local addresses matching --ice-address,
+ * rather than on every interface, before gathering starts */
+static void
+restrict_ice_addresses (NiceAgent * agent)
+{
+  GList *ips, *l;
+  guint i, restricted = 0;
+
+  ips = nice_interfaces_get_local_ips (TRUE);
+  for (l = ips; l; l = l->next) {
+    for (i = 0; ice_addresses[i]; i++) {
+      NiceAddress address;
+
+      if (!g_str_has_prefix (l->data, ice_addresses[i]))
+        continue;
+      if (nice_address_set_from_string (&address, l->data) &&
+          nice_agent_add_local_address (agent, &address))
+        restricted++;
+      break;
+    }
+  }
+  g_list_free_full (ips, g_free);
+
+  /* libnice then gathers everywhere, and all of it gets dropped */
+  if (!restricted)
+    gst_printerr ("No local address matches --ice-address, no candidates "
+        "will be offered\n");
+}
+
 static void
 send_ice_candidate_message (GstElement * webrtc G_GNUC_UNUSED, guint mlineindex,
     gchar * candidate, gpointer user_data G_GNUC_UNUSED)
@@ -376,6 +1134,19 @@ send_ice_candidate_message (GstElement * webrtc G_GNUC_UNUSED, guint mlineindex,
   gchar *text;
   JsonObject *ice, *msg;
 
+  metrics_add_local_port (candidate);
+  remember_candidate_kind ("L:", candidate);
+
+  /* No trickle ICE with WHIP/WHEP, our candidates go in the answer */
+  if (!ws_conn)
+    return;
+
+  if (!candidate_allowed (candidate)) {
+    metrics.candidates_dropped++;
+    return;
+  }
+  metrics.candidates_sent++;
+
   if (app_state < PEER_CALL_NEGOTIATING) {
     cleanup_and_quit_loop ("Can't send ICE, not in call", APP_STATE_ERROR);
     return;
@@ -389,7 +1160,7 @@ send_ice_candidate_message (GstElement * webrtc G_GNUC_UNUSED, guint mlineindex,
   text = get_string_from_json_object (msg);
   json_object_unref (msg);
 
-  soup_websocket_connection_send_text (ws_conn, text);
+  send_text_to_peer (text);
   g_free (text);
 }
 
@@ -426,7 +1197,7 @@ send_sdp_to_peer (GstWebRTCSessionDescription * desc)
   text = get_string_from_json_object (msg);
   json_object_unref (msg);
 
-  soup_websocket_connection_send_text (ws_conn, text);
+  send_text_to_peer (text);
   g_free (text);
 }
 
@@ -477,6 +1248,9 @@ static void
 on_negotiation_needed (GstElement * element, gpointer user_data)
 {
   gst_print ("on_negotiation_needed()\n");
+  /* WHIP/WHEP clients always send the offer, we only answer */
+  if (!ws_conn)
+    return;
   //soup_websocket_connection_send_text (ws_conn, "OFFER_REQUEST");
   create_offer();
 }
@@ -484,6 +1258,7 @@ on_negotiation_needed (GstElement * element, gpointer user_data)
 static void
 data_channel_on_close (GObject * dc, gpointer user_data)
 {
+  g_clear_object (&data_channel);
   cleanup_and_quit_loop ("Data channel closed", 0);
 }
 
@@ -494,75 +1269,1143 @@ void add_ghost_src(GstElement* bin, GstElement* el) {
   gst_object_unref(src);
 }
 
-static GstPad* send_media_to_browser(GstElement* bin) {
-  gst_element_set_locked_state(bin, TRUE);
-  gst_bin_add(GST_BIN(pipe1), bin);
+static gboolean
+has_marker (GstBuffer * buffer)
+{
+  GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+  gboolean marker;
 
-  // explicitly link pads to get reference to sink
-  GstPad* src = gst_element_get_static_pad(bin, "src");
-  GstPad* sink = gst_element_request_pad_simple(webrtc1, "sink_%u");
+  if (!gst_rtp_buffer_map (buffer, GST_MAP_READ, &rtp))
+    return FALSE;
+  marker = gst_rtp_buffer_get_marker (&rtp);
+  gst_rtp_buffer_unmap (&rtp);
+  return marker;
+}
 
+static gboolean
+add_to_batch (GstBuffer ** buffer, guint idx, GstBufferList * batch)
+{
+  gst_buffer_list_add (batch, gst_buffer_ref (*buffer));
+  return TRUE;
+}
 
-  gchar *sink_name;
-  g_object_get(sink, "name", &sink_name, NULL);
-  gst_print ("send_media_to_browser() new sink named: %s\n", sink_name);
-  g_free(sink_name);
+static void
+free_batch (GstBufferList ** batch)
+{
+  g_clear_pointer (batch, gst_buffer_list_unref);
+  g_free (batch);
+}
 
-  gst_pad_link(src, sink);
+/* With --rtp-buffer-lists: hold back payloaded packets until the one with the
+ * marker bit, the last of the frame, and push them all downstream as one
+ * buffer list. Everything after the payloader (rtpsession, srtpenc, nicesink)
+ * handles lists, and nicesink sends a list with a single sendmmsg. */
+static GstPadProbeReturn
+batch_probe (GstPad * pad, GstPadProbeInfo * info, GstBufferList ** batch)
+{
+  GstBuffer *last;
+  GstPad *peer;
+  GstFlowReturn ret;
 
-  gst_object_unref(src);
+  if (!*batch)
+    *batch = gst_buffer_list_new ();
 
-  gst_element_set_locked_state(bin, FALSE);
-  gst_element_sync_state_with_parent(bin);
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+    gst_buffer_list_foreach (list, (GstBufferListFunc) add_to_batch, *batch);
+    gst_buffer_list_unref (list);
+  } else {
+    gst_buffer_list_add (*batch, GST_PAD_PROBE_INFO_BUFFER (info));
+  }
+  GST_PAD_PROBE_INFO_DATA (info) = NULL;
 
-  return sink;
+  last = gst_buffer_list_get (*batch, gst_buffer_list_length (*batch) - 1);
+  if (!has_marker (last))
+    return GST_PAD_PROBE_HANDLED;
+
+  peer = gst_pad_get_peer (pad);
+  ret = gst_pad_chain_list (peer, *batch);
+  gst_object_unref (peer);
+  *batch = NULL;
+
+  GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+  return GST_PAD_PROBE_HANDLED;
 }
 
-static void stop_media_to_browser(GstElement* element, GstPad *sink) {
-  GstPad *src;
-  GstWebRTCRTPTransceiver* transceiver;
+static gdouble
+cpu_time (clockid_t clock)
+{
+  struct timespec ts;
 
-  src = gst_element_get_static_pad(element, "src");
+  clock_gettime (clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  gst_element_send_event(element, gst_event_new_eos());
+static gdouble
+process_cpu_time (void)
+{
+  return cpu_time (CLOCK_PROCESS_CPUTIME_ID);
+}
 
-  g_object_get(sink, "transceiver", &transceiver, NULL);
+/* Record the CPU time of the streaming thread we're called from. A thread's
+ * usage is counted from the first time we see it in this session. */
+static void
+sample_thread_cpu (void)
+{
+  gdouble now = cpu_time (CLOCK_THREAD_CPUTIME_ID);
+  struct ThreadCpu *t;
+
+  g_mutex_lock (&thread_cpu_lock);
+  if (thread_cpu) {
+    t = g_hash_table_lookup (thread_cpu, g_thread_self ());
+    if (!t) {
+      t = g_new (struct ThreadCpu, 1);
+      t->first = now;
+      g_hash_table_insert (thread_cpu, g_thread_self (), t);
+    }
+    t->last = now;
+  }
+  g_mutex_unlock (&thread_cpu_lock);
+}
 
-  GstWebRTCKind kind;
-  g_object_get(transceiver, "kind", &kind, NULL);
-  //GstWebRTCRTPTransceiverDirection dir;
-  //g_object_get(transceiver, "direction", &dir, NULL);
-  //if(dir == GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDRECV) {
-  if((incoming_audio_pad_name && kind == GST_WEBRTC_KIND_AUDIO) ||
-      (incoming_video_pad_name && kind == GST_WEBRTC_KIND_VIDEO)) {
-    gst_print ("stop_media_to_browser() Setting transceiver direction to recvonly\n");
-    g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, NULL);
-  } else {
-    gst_print ("stop_media_to_browser() Setting transceiver direction to inactive\n");
-    g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_INACTIVE, NULL);
+static gdouble
+session_thread_cpu (guint * n_threads)
+{
+  GHashTableIter iter;
+  struct ThreadCpu *t;
+  gdouble total = 0;
+
+  g_mutex_lock (&thread_cpu_lock);
+  *n_threads = thread_cpu ? g_hash_table_size (thread_cpu) : 0;
+  if (thread_cpu) {
+    g_hash_table_iter_init (&iter, thread_cpu);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & t))
+      total += t->last - t->first;
   }
+  g_mutex_unlock (&thread_cpu_lock);
+  return total;
+}
 
-  gst_element_set_locked_state(element, TRUE);
-  gst_element_set_state(element, GST_STATE_NULL);
-  gst_pad_unlink(src, sink);
-  gst_element_release_request_pad(webrtc1, sink);
+static gboolean
+count_buffer (GstBuffer ** buffer, guint idx, struct StreamCounters *counters)
+{
+  counters->buffers++;
+  counters->bytes += gst_buffer_get_size (*buffer);
+  if (has_marker (*buffer))
+    counters->frames++;
+  return TRUE;
+}
 
-  gst_object_unref(transceiver);
-  gst_object_unref(sink);
-  gst_object_unref(src);
+/* Counts RTP into the struct StreamCounters passed as @user_data */
+static GstPadProbeReturn
+count_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  struct StreamCounters *counters = user_data;
 
-  gst_bin_remove(GST_BIN(pipe1), element);
+  counters->pushes++;
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+    gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info),
+        (GstBufferListFunc) count_buffer, counters);
+  } else {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    count_buffer (&buffer, 0, counters);
+  }
+  sample_thread_cpu ();
+  return GST_PAD_PROBE_OK;
+}
 
+static void
+add_count_probe (GstElement * element, const gchar * pad_name,
+    struct StreamCounters *counters)
+{
+  GstPad *pad = gst_element_get_static_pad (element, pad_name);
 
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, count_probe, counters, NULL);
+  gst_object_unref (pad);
 }
 
+/* With --pace, video goes out at no more than PACE_FACTOR times its
+ * bitrate, with up to PACE_BURST worth of packets back to back. webrtcbin
+ * has no bandwidth estimate for us to follow, and the video doesn't overshoot
+ * its bitrate by that much for long, so this spreads a keyframe over a few
+ * frame intervals without building up a queue. The bitrate is measured, a
+ * file or the pre-encoded pattern can have any; until there's a measurement
+ * it's the encoder's. Audio isn't paced. */
+#define PACE_FACTOR 2.5
+#define PACE_BURST (2 * GST_MSECOND)
+#define PACE_RATE_WINDOW GST_SECOND
+/* What the pacer's queue holds at most, it drops the oldest beyond that
+ * rather than fall further behind */
+#define PACE_QUEUE_MAX (300 * GST_MSECOND)
+/* Packets less than this apart count as one burst */
+#define BURST_GAP GST_MSECOND
 
-static gboolean send_video_to_browser(enum AppVideoSource source) {
-  gst_print ("send_video_to_browser() source: %s\n", video_source_to_string(source));
-
-  GstElement *videosrc = NULL, *shmsrc=NULL;
+static void
+pace_measure_rate (GstBuffer * buffer)
+{
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
 
-  if(source == VIDEO_SOURCE_TEST_PATTERN) {
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return;
+  if (!metrics.pace_window_bytes || pts < metrics.pace_window_start) {
+    metrics.pace_window_start = pts;
+    metrics.pace_window_bytes = 0;
+  }
+  metrics.pace_window_bytes += gst_buffer_get_size (buffer);
+  if (pts - metrics.pace_window_start >= PACE_RATE_WINDOW) {
+    metrics.pace_rate = gst_util_uint64_scale (metrics.pace_window_bytes * 8,
+        GST_SECOND, pts - metrics.pace_window_start);
+    metrics.pace_window_start = pts;
+    metrics.pace_window_bytes = 0;
+  }
+}
+
+/* Whether pace_packet() would wait before sending the next packet */
+static gboolean
+pace_must_wait (void)
+{
+  GstClock *clock = gst_system_clock_obtain ();
+  gboolean wait = metrics.pace_next > gst_clock_get_time (clock);
+
+  gst_object_unref (clock);
+  return wait;
+}
+
+static void
+pace_packet (GstBuffer * buffer)
+{
+  GstClock *clock = gst_system_clock_obtain ();
+  GstClockTime now = gst_clock_get_time (clock);
+  GstClockID id;
+
+  if (pace_video) {
+    g_mutex_lock (&pace_lock);
+    if (metrics.pace_next > now && !pace_flushing) {
+      id = pace_wait = gst_clock_new_single_shot_id (clock, metrics.pace_next);
+      g_mutex_unlock (&pace_lock);
+      gst_clock_id_wait (id, NULL);
+      g_mutex_lock (&pace_lock);
+      pace_wait = NULL;
+      gst_clock_id_unref (id);
+      now = gst_clock_get_time (clock);
+    }
+    g_mutex_unlock (&pace_lock);
+    pace_measure_rate (buffer);
+    metrics.pace_next = MAX (metrics.pace_next, now - PACE_BURST) +
+        gst_util_uint64_scale (gst_buffer_get_size (buffer) * 8, GST_SECOND,
+        (metrics.pace_rate ? metrics.pace_rate : VIDEO_BITRATE * 1000) *
+        PACE_FACTOR);
+  }
+
+  if (metrics.last_departure && now - metrics.last_departure < BURST_GAP) {
+    metrics.burst_len++;
+  } else {
+    metrics.bursts++;
+    metrics.burst_len = 1;
+  }
+  metrics.burst_max = MAX (metrics.burst_max, metrics.burst_len);
+  metrics.last_departure = now;
+  gst_object_unref (clock);
+}
+
+/* Wake the pacer up and stop it from waiting until pace_resume() */
+static void
+pace_unschedule (void)
+{
+  g_mutex_lock (&pace_lock);
+  pace_flushing = TRUE;
+  if (pace_wait)
+    gst_clock_id_unschedule (pace_wait);
+  g_mutex_unlock (&pace_lock);
+}
+
+static void
+pace_resume (void)
+{
+  g_mutex_lock (&pace_lock);
+  pace_flushing = FALSE;
+  g_mutex_unlock (&pace_lock);
+}
+
+/* A flush has to get through to webrtcbin while the pacer is waiting */
+static GstPadProbeReturn
+pace_flush_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START)
+    pace_unschedule ();
+  else if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+    pace_resume ();
+  return GST_PAD_PROBE_OK;
+}
+
+/* On the video bin's last queue, so the waiting doesn't hold up encoding.
+ * With --rtp-buffer-lists, a frame's packets still go out as lists when
+ * pacing: each run of them that can leave without waiting is one list. */
+static GstPadProbeReturn
+pace_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstBufferList *list, *run;
+  GstBuffer *buffer;
+  GstPad *peer;
+  guint i, n;
+
+  if (!(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)) {
+    pace_packet (GST_PAD_PROBE_INFO_BUFFER (info));
+    return GST_PAD_PROBE_OK;
+  }
+
+  list = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
+  n = gst_buffer_list_length (list);
+  if (!pace_video) {
+    for (i = 0; i < n; i++)
+      pace_packet (gst_buffer_list_get (list, i));
+    return GST_PAD_PROBE_OK;
+  }
+
+  peer = gst_pad_get_peer (pad);
+  run = gst_buffer_list_new ();
+  for (i = 0; i < n && ret == GST_FLOW_OK; i++) {
+    buffer = gst_buffer_list_get (list, i);
+    if (gst_buffer_list_length (run) > 0 && pace_must_wait ()) {
+      ret = gst_pad_chain_list (peer, run);
+      run = gst_buffer_list_new ();
+      if (ret != GST_FLOW_OK)
+        break;
+    }
+    pace_packet (buffer);
+    gst_buffer_list_add (run, gst_buffer_ref (buffer));
+  }
+  if (ret == GST_FLOW_OK && gst_buffer_list_length (run) > 0)
+    ret = gst_pad_chain_list (peer, run);
+  else
+    gst_buffer_list_unref (run);
+  gst_object_unref (peer);
+  gst_buffer_list_unref (list);
+  GST_PAD_PROBE_INFO_DATA (info) = NULL;
+
+  GST_PAD_PROBE_INFO_FLOW_RETURN (info) = ret;
+  return GST_PAD_PROBE_HANDLED;
+}
+
+/* Frames waiting in the encoder, see encoder_in_probe() */
+struct EncoderFrames
+{
+  GMutex lock;
+  GQueue frames;
+};
+
+struct EncoderFrame
+{
+  GstClockTime pts;
+  gint64 in;
+};
+
+static void
+encoder_frames_free (struct EncoderFrames *frames)
+{
+  g_queue_clear_full (&frames->frames, g_free);
+  g_mutex_clear (&frames->lock);
+  g_free (frames);
+}
+
+static GstPadProbeReturn
+encoder_in_probe (GstPad * pad, GstPadProbeInfo * info,
+    struct EncoderFrames *frames)
+{
+  struct EncoderFrame *frame = g_new (struct EncoderFrame, 1);
+
+  frame->pts = GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info));
+  frame->in = g_get_monotonic_time ();
+  g_mutex_lock (&frames->lock);
+  g_queue_push_tail (&frames->frames, frame);
+  g_mutex_unlock (&frames->lock);
+  sample_thread_cpu ();
+  return GST_PAD_PROBE_OK;
+}
+
+/* Frames come out in order, we don't use B-frames. Frames the encoder
+ * dropped are skipped. */
+static GstPadProbeReturn
+encoder_out_probe (GstPad * pad, GstPadProbeInfo * info,
+    struct EncoderFrames *frames)
+{
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+  struct EncoderFrame *frame;
+  gint64 elapsed;
+
+  metrics.encoded_size_max = MAX (metrics.encoded_size_max,
+      gst_buffer_get_size (buffer));
+
+  g_mutex_lock (&frames->lock);
+  while ((frame = g_queue_pop_head (&frames->frames))) {
+    if (frame->pts == pts || !GST_CLOCK_TIME_IS_VALID (pts))
+      break;
+    g_free (frame);
+  }
+  g_mutex_unlock (&frames->lock);
+
+  if (frame) {
+    elapsed = g_get_monotonic_time () - frame->in;
+    metrics.encoded_frames++;
+    metrics.encode_time += elapsed;
+    metrics.encode_time_max = MAX (metrics.encode_time_max, elapsed);
+    g_free (frame);
+  }
+  sample_thread_cpu ();
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+add_encoder_probes (GstElement * encoder)
+{
+  struct EncoderFrames *frames = g_new0 (struct EncoderFrames, 1);
+  GstPad *pad;
+
+  g_mutex_init (&frames->lock);
+  g_queue_init (&frames->frames);
+  /* Lives as long as the encoder */
+  g_object_set_data_full (G_OBJECT (encoder), "frames", frames,
+      (GDestroyNotify) encoder_frames_free);
+
+  pad = gst_element_get_static_pad (encoder, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) encoder_in_probe, frames, NULL);
+  gst_object_unref (pad);
+  pad = gst_element_get_static_pad (encoder, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+      (GstPadProbeCallback) encoder_out_probe, frames, NULL);
+  gst_object_unref (pad);
+}
+
+static JsonObject *
+stream_counters_to_json (struct StreamCounters *counters)
+{
+  JsonObject *object = json_object_new ();
+
+  json_object_set_int_member (object, "pushes", counters->pushes);
+  json_object_set_int_member (object, "buffers", counters->buffers);
+  json_object_set_int_member (object, "bytes", counters->bytes);
+  json_object_set_int_member (object, "frames", counters->frames);
+  return object;
+}
+
+/* Everything we account for this session, for the STATS message */
+static gchar *
+session_stats_to_json (void)
+{
+  JsonObject *stats = json_object_new (), *encoder = json_object_new ();
+  guint n_threads;
+  gdouble thread_cpu_s = session_thread_cpu (&n_threads);
+  gchar *text;
+
+  json_object_set_double_member (stats, "uptime_s",
+      metrics_ms (metrics.start, g_get_monotonic_time ()) / 1000.0);
+  json_object_set_object_member (stats, "video_out",
+      stream_counters_to_json (&metrics.video_out));
+  json_object_set_object_member (stats, "audio_out",
+      stream_counters_to_json (&metrics.audio_out));
+  json_object_set_object_member (stats, "in",
+      stream_counters_to_json (&metrics.media_in));
+
+  json_object_set_int_member (encoder, "frames", metrics.encoded_frames);
+  json_object_set_double_member (encoder, "avg_ms", metrics.encoded_frames ?
+      metrics.encode_time / 1000.0 / metrics.encoded_frames : 0.0);
+  json_object_set_double_member (encoder, "max_ms",
+      metrics.encode_time_max / 1000.0);
+  json_object_set_int_member (encoder, "max_frame_bytes",
+      metrics.encoded_size_max);
+  json_object_set_object_member (stats, "encoder", encoder);
+
+  if (metrics.loopback_frames) {
+    JsonObject *loopback = json_object_new ();
+    json_object_set_int_member (loopback, "frames", metrics.loopback_frames);
+    json_object_set_double_member (loopback, "avg_ms",
+        metrics.loopback_time / 1000.0 / metrics.loopback_frames);
+    json_object_set_double_member (loopback, "max_ms",
+        metrics.loopback_time_max / 1000.0);
+    json_object_set_object_member (stats, "loopback", loopback);
+  }
+
+  json_object_set_double_member (stats, "thread_cpu_s", thread_cpu_s);
+  json_object_set_int_member (stats, "threads", n_threads);
+
+  json_object_set_int_member (stats, "video_bursts", metrics.bursts);
+  json_object_set_int_member (stats, "video_burst_max", metrics.burst_max);
+  json_object_set_int_member (stats, "packets_sent", metrics.packets_sent);
+  json_object_set_int_member (stats, "remote_packets_lost",
+      metrics.remote_packets_lost);
+
+  json_object_set_int_member (stats, "errors", metrics.errors);
+  json_object_set_int_member (stats, "warnings", metrics.warnings);
+  json_object_set_int_member (stats, "qos_messages", metrics.qos_messages);
+  json_object_set_int_member (stats, "qos_dropped", metrics.qos_dropped);
+  if (branch_latency)
+    json_object_set_object_member (stats, "latency_ms",
+        json_object_ref (branch_latency));
+
+  text = get_string_from_json_object (stats);
+  json_object_unref (stats);
+  return text;
+}
+
+#define SESSION_STATS_INTERVAL 5
+/* Per packet on top of the RTP payload: RTP header, SRTP auth tag, UDP/IP */
+#define PACKET_OVERHEAD (12 + 10 + 28)
+
+/* Integer stats come in different types, this takes any of them */
+static gint64
+get_stat_int (const GstStructure * stat, const gchar * field)
+{
+  const GValue *value = gst_structure_get_value (stat, field);
+  GValue v = G_VALUE_INIT;
+  gint64 n = 0;
+
+  g_value_init (&v, G_TYPE_INT64);
+  if (value && g_value_transform (value, &v))
+    n = g_value_get_int64 (&v);
+  g_value_unset (&v);
+  return n;
+}
+
+static gboolean
+add_rtp_stat (GQuark field_id, const GValue * value, guint64 * totals)
+{
+  const GstStructure *stat;
+  GstWebRTCStatsType type;
+
+  if (!GST_VALUE_HOLDS_STRUCTURE (value))
+    return TRUE;
+  stat = gst_value_get_structure (value);
+  if (!gst_structure_get (stat, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type,
+          NULL))
+    return TRUE;
+  if (type == GST_WEBRTC_STATS_OUTBOUND_RTP)
+    totals[0] += get_stat_int (stat, "packets-sent");
+  else if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP)
+    totals[1] += MAX (get_stat_int (stat, "packets-lost"), 0);
+  return TRUE;
+}
+
+/* Packets we sent, from our outbound-rtp stats, and how many of them the
+ * browser reports lost, from remote-inbound-rtp, for the next
+ * print_session_stats() */
+static void
+on_loss_stats (GstPromise * promise, gpointer user_data)
+{
+  guint64 totals[2] = { 0, 0 };
+
+  if (gst_promise_wait (promise) == GST_PROMISE_RESULT_REPLIED) {
+    gst_structure_foreach (gst_promise_get_reply (promise),
+        (GstStructureForeachFunc) add_rtp_stat, totals);
+    metrics.packets_sent = totals[0];
+    metrics.remote_packets_lost = totals[1];
+  }
+  gst_promise_unref (promise);
+}
+
+/* Print what we sent since the last call, and send the session's totals to
+ * the browser. With one session per process, the process CPU time is this
+ * session's; the thread CPU time is what we could attribute to it. */
+static gboolean
+print_session_stats (void)
+{
+  gdouble cpu = process_cpu_time (), mbps;
+  guint64 pushes = metrics.video_out.pushes - metrics.video_reported.pushes;
+  guint64 packets = metrics.video_out.buffers - metrics.video_reported.buffers;
+  guint64 frames = metrics.video_out.frames - metrics.video_reported.frames;
+  gchar *stats;
+
+  if (webrtc1)
+    g_signal_emit_by_name (webrtc1, "get-stats", NULL,
+        gst_promise_new_with_change_func (on_loss_stats, NULL, NULL));
+
+  mbps = (metrics.video_out.bytes - metrics.video_reported.bytes) * 8.0 /
+      1e6 / SESSION_STATS_INTERVAL;
+  if (packets) {
+    gst_print ("Video: %.2f Mbps, %" G_GUINT64_FORMAT " packets in %"
+        G_GUINT64_FORMAT " pushes (%.1f packets/push), %.1f ms CPU per "
+        "Mbps per second\n", mbps, packets, pushes,
+        (gdouble) packets / pushes, mbps > 0 ?
+        (cpu - metrics.reported_cpu) * 1000.0 / SESSION_STATS_INTERVAL / mbps :
+        0.0);
+  }
+  if (frames) {
+    gst_print ("Video: %.1f packets per frame, about %.0f bytes of headers "
+        "per frame at MTU %d\n", (gdouble) packets / frames,
+        (gdouble) packets * PACKET_OVERHEAD / frames, session_config.mtu);
+  }
+
+  if (metrics.encoded_frames) {
+    gst_print ("Encoder: %.2f ms per frame on average, %.2f ms max, "
+        "largest frame %" G_GSIZE_FORMAT " bytes\n",
+        metrics.encode_time / 1000.0 / metrics.encoded_frames,
+        metrics.encode_time_max / 1000.0, metrics.encoded_size_max);
+  }
+  gst_print ("Video: %" G_GUINT64_FORMAT " bursts, longest %u packets; "
+      "%" G_GUINT64_FORMAT " packets sent, %" G_GUINT64_FORMAT
+      " reported lost by the browser\n", metrics.bursts, metrics.burst_max,
+      metrics.packets_sent, metrics.remote_packets_lost);
+  if (metrics.loopback_frames) {
+    gst_print ("Loopback: %.2f ms per frame on average, %.2f ms max\n",
+        metrics.loopback_time / 1000.0 / metrics.loopback_frames,
+        metrics.loopback_time_max / 1000.0);
+  }
+
+  stats = session_stats_to_json ();
+  gst_print ("Session: %s\n", stats);
+  if (data_channel) {
+    gchar *msg = g_strdup_printf ("STATS %s", stats);
+    g_signal_emit_by_name (data_channel, "send-string", msg);
+    g_free (msg);
+  }
+  g_free (stats);
+
+  metrics.video_reported = metrics.video_out;
+  metrics.reported_cpu = cpu;
+  return G_SOURCE_CONTINUE;
+}
+
+static GstPad* send_media_to_browser(GstElement* bin) {
+  gst_element_set_locked_state(bin, TRUE);
+  gst_bin_add(GST_BIN(pipe1), bin);
+
+  // explicitly link pads to get reference to sink
+  GstPad* src = gst_element_get_static_pad(bin, "src");
+  GstPad* sink = gst_element_request_pad_simple(webrtc1, "sink_%u");
+
+
+  gchar *sink_name;
+  g_object_get(sink, "name", &sink_name, NULL);
+  gst_print ("send_media_to_browser() new sink named: %s\n", sink_name);
+  g_free(sink_name);
+
+  gst_pad_link(src, sink);
+
+  gst_object_unref(src);
+
+  gst_element_set_locked_state(bin, FALSE);
+  gst_element_sync_state_with_parent(bin);
+
+  return sink;
+}
+
+static void stop_media_to_browser(GstElement* element, GstPad *sink) {
+  GstPad *src;
+  GstWebRTCRTPTransceiver* transceiver;
+
+  src = gst_element_get_static_pad(element, "src");
+
+  gst_element_send_event(element, gst_event_new_eos());
+
+  g_object_get(sink, "transceiver", &transceiver, NULL);
+
+  GstWebRTCKind kind;
+  g_object_get(transceiver, "kind", &kind, NULL);
+  //GstWebRTCRTPTransceiverDirection dir;
+  //g_object_get(transceiver, "direction", &dir, NULL);
+  //if(dir == GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDRECV) {
+  if((incoming_audio_pad_name && kind == GST_WEBRTC_KIND_AUDIO) ||
+      (incoming_video_pad_name && kind == GST_WEBRTC_KIND_VIDEO)) {
+    gst_print ("stop_media_to_browser() Setting transceiver direction to recvonly\n");
+    g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_RECVONLY, NULL);
+  } else {
+    gst_print ("stop_media_to_browser() Setting transceiver direction to inactive\n");
+    g_object_set(transceiver, "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_INACTIVE, NULL);
+  }
+
+  gst_element_set_locked_state(element, TRUE);
+  gst_element_set_state(element, GST_STATE_NULL);
+  gst_pad_unlink(src, sink);
+  gst_element_release_request_pad(webrtc1, sink);
+
+  gst_object_unref(transceiver);
+  gst_object_unref(sink);
+  gst_object_unref(src);
+
+  gst_bin_remove(GST_BIN(pipe1), element);
+
+
+}
+
+
+/* A session's appsrc, fed by the media file reader */
+struct MediaSubscriber
+{
+  GstElement *appsrc;
+  gboolean video;
+  gboolean started;
+  /* Started with the cached IDR only, skipping until the next one */
+  gboolean wait_idr;
+  /* Of the last buffer we pushed */
+  GstClockTime last_pts;
+};
+
+/* Push @sample to @sub, with @pts and @dts in the session's running time.
+ * Returns FALSE once the appsrc is flushing. */
+static gboolean
+media_file_push (struct MediaSubscriber *sub, GstSample * sample,
+    GstClockTime pts, GstClockTime dts)
+{
+  GstBuffer *out = gst_buffer_copy (gst_sample_get_buffer (sample));
+  GstFlowReturn ret;
+
+  /* Frames after the cached ones we started with can come out earlier */
+  if (GST_CLOCK_TIME_IS_VALID (sub->last_pts) && pts <= sub->last_pts) {
+    pts = sub->last_pts + GOP_PRIME_SPACING;
+    dts = pts;
+  }
+  GST_BUFFER_PTS (out) = pts;
+  GST_BUFFER_DTS (out) = dts;
+  sub->last_pts = pts;
+  g_signal_emit_by_name (sub->appsrc, "push-buffer", out, &ret);
+  gst_buffer_unref (out);
+  return ret == GST_FLOW_OK;
+}
+
+/* Keep the video since the last IDR in media_file_gop */
+static void
+media_file_cache (GstSample * sample)
+{
+  GstBuffer *buffer = gst_sample_get_buffer (sample);
+
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    g_ptr_array_set_size (media_file_gop, 0);
+  else if (media_file_gop->len == 0 ||
+      media_file_gop->len >= MEDIA_FILE_GOP_MAX) {
+    g_ptr_array_set_size (media_file_gop, 0);
+    return;
+  }
+  g_ptr_array_add (media_file_gop, gst_sample_ref (sample));
+}
+
+/* Called from the reader's streaming threads. The appsinks sync, so this
+ * is paced by the file's timestamps. Timestamps are the reader's running
+ * time, which keeps going up across loops, moved to each session's. */
+static GstFlowReturn
+on_media_file_sample (GstElement * appsink, gpointer user_data)
+{
+  gboolean video = GPOINTER_TO_INT (user_data);
+  struct MediaSubscriber *sub;
+  const GstSegment *segment;
+  GstClockTime pts, dts;
+  GstSample *sample;
+  GstBuffer *buffer;
+  GList *l, *next;
+
+  g_signal_emit_by_name (appsink, "pull-sample", &sample);
+  if (!sample)
+    return GST_FLOW_EOS;
+  buffer = gst_sample_get_buffer (sample);
+  segment = gst_sample_get_segment (sample);
+  pts = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+      GST_BUFFER_PTS (buffer));
+  dts = gst_segment_to_running_time (segment, GST_FORMAT_TIME,
+      GST_BUFFER_DTS (buffer));
+
+  g_mutex_lock (&media_file_lock);
+  if (video)
+    media_file_cache (sample);
+  for (l = media_subscribers; l; l = next) {
+    sub = l->data;
+    next = l->next;
+    if (sub->video != video || !GST_CLOCK_TIME_IS_VALID (pts))
+      continue;
+
+    if (!sub->started) {
+      /* Video has to start on an IDR, h264parse puts SPS/PPS in front of
+       * each */
+      if (video && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        continue;
+      if (!GST_CLOCK_TIME_IS_VALID (media_file_offset)) {
+        media_file_offset = GST_CLOCK_TIME_IS_VALID (dts) ? MIN (pts, dts) :
+            pts;
+        media_file_base = gst_element_get_current_running_time (sub->appsrc);
+        if (!GST_CLOCK_TIME_IS_VALID (media_file_base))
+          media_file_base = 0;
+      }
+      g_object_set (sub->appsrc, "caps", gst_sample_get_caps (sample), NULL);
+      sub->started = TRUE;
+    }
+    if (sub->wait_idr) {
+      if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        continue;
+      sub->wait_idr = FALSE;
+    }
+    /* From before the session's timeline started */
+    if (pts < media_file_offset)
+      continue;
+
+    /* Flushing once the session stopped the stream or ended */
+    if (!media_file_push (sub, sample, media_file_base + pts -
+            media_file_offset, GST_CLOCK_TIME_IS_VALID (dts) &&
+            dts >= media_file_offset ? media_file_base + dts -
+            media_file_offset : GST_CLOCK_TIME_NONE)) {
+      media_subscribers = g_list_delete_link (media_subscribers, l);
+      gst_object_unref (sub->appsrc);
+      g_free (sub);
+    }
+  }
+  g_mutex_unlock (&media_file_lock);
+
+  gst_sample_unref (sample);
+  return GST_FLOW_OK;
+}
+
+/* Each session starts a new timeline */
+static void
+media_file_new_session (void)
+{
+  g_mutex_lock (&media_file_lock);
+  media_file_offset = GST_CLOCK_TIME_NONE;
+  media_file_base = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (&media_file_lock);
+}
+
+/* An appsrc for the file's video or audio. Subscribe it with
+ * media_file_subscribe() once it's in the running pipeline. */
+static GstElement *
+media_file_source (void)
+{
+  GstElement *appsrc = gst_element_factory_make ("appsrc", NULL);
+
+  g_object_set (appsrc, "is-live", TRUE, "format", GST_FORMAT_TIME, NULL);
+  return appsrc;
+}
+
+/* Video starts with the cached GOP, rather than at the next IDR. When it's
+ * short, its frames go out right away, GOP_PRIME_SPACING apart, ending where
+ * the live stream is, so the browser decodes through to the current frame
+ * at once. A longer one isn't replayed, the browser shows its IDR until the
+ * next one. */
+static void
+media_file_subscribe (GstElement * appsrc, gboolean video)
+{
+  struct MediaSubscriber *sub = g_new0 (struct MediaSubscriber, 1);
+  GstSample *last;
+  GstClockTime pts, last_pts;
+  guint i, n, prime;
+
+  sub->appsrc = gst_object_ref (appsrc);
+  sub->video = video;
+  sub->last_pts = GST_CLOCK_TIME_NONE;
+  g_mutex_lock (&media_file_lock);
+  n = media_file_gop->len;
+  prime = n > 1 + GOP_PRIME_TAIL ? 1 : n;
+  if (video && n > 0) {
+    last = g_ptr_array_index (media_file_gop, n - 1);
+    last_pts = gst_segment_to_running_time (gst_sample_get_segment (last),
+        GST_FORMAT_TIME, GST_BUFFER_PTS (gst_sample_get_buffer (last)));
+    if (!GST_CLOCK_TIME_IS_VALID (media_file_offset)) {
+      media_file_offset = last_pts;
+      media_file_base = gst_element_get_current_running_time (appsrc);
+      if (!GST_CLOCK_TIME_IS_VALID (media_file_base))
+        media_file_base = 0;
+      media_file_base += (prime - 1) * GOP_PRIME_SPACING;
+    }
+    g_object_set (appsrc, "caps", gst_sample_get_caps (last), NULL);
+    sub->started = TRUE;
+    /* Where the last cached frame is in the session's timeline */
+    pts = media_file_base;
+    if (last_pts > media_file_offset)
+      pts += last_pts - media_file_offset;
+    pts -= MIN (pts, (prime - 1) * GOP_PRIME_SPACING);
+    for (i = 0; i < prime; i++, pts += GOP_PRIME_SPACING)
+      media_file_push (sub, g_ptr_array_index (media_file_gop, i), pts, pts);
+    sub->wait_idr = prime < n;
+    gst_print ("Media file: started the session with %u of %u cached "
+        "frames\n", prime, n);
+  }
+  media_subscribers = g_list_append (media_subscribers, sub);
+  g_mutex_unlock (&media_file_lock);
+}
+
+static void
+on_media_reader_pad_added (GstElement * parsebin, GstPad * pad,
+    gpointer user_data)
+{
+  GstCaps *caps = gst_pad_get_current_caps (pad);
+  const gchar *name;
+  GstElement *queue, *parse, *capsfilter, *sink;
+  GstPad *sinkpad;
+  gboolean video;
+
+  if (!caps)
+    caps = gst_pad_query_caps (pad, NULL);
+  name = gst_structure_get_name (gst_caps_get_structure (caps, 0));
+  video = g_str_equal (name, "video/x-h264");
+  if (!video && !g_str_equal (name, "audio/x-opus")) {
+    gst_print ("Media file: ignoring %s stream\n", name);
+    gst_caps_unref (caps);
+    return;
+  }
+  gst_print ("Media file: %s stream\n", name);
+  gst_caps_unref (caps);
+
+  queue = gst_element_factory_make ("queue", NULL);
+  sink = gst_element_factory_make ("appsink", NULL);
+  /* A file without audio still has to preroll */
+  g_object_set (sink, "sync", TRUE, "async", video, "emit-signals", TRUE,
+      NULL);
+  g_signal_connect (sink, "new-sample", G_CALLBACK (on_media_file_sample),
+      GINT_TO_POINTER (video));
+  gst_bin_add_many (GST_BIN (media_reader), queue, sink, NULL);
+
+  if (video) {
+    parse = gst_element_factory_make ("h264parse", NULL);
+    /* Sessions join at any IDR */
+    g_object_set (parse, "config-interval", -1, NULL);
+    capsfilter = gst_element_factory_make ("capsfilter", NULL);
+    caps = gst_caps_from_string ("video/x-h264, stream-format=byte-stream, "
+        "alignment=au");
+    g_object_set (capsfilter, "caps", caps, NULL);
+    gst_caps_unref (caps);
+    gst_bin_add_many (GST_BIN (media_reader), parse, capsfilter, NULL);
+    gst_element_link_many (queue, parse, capsfilter, sink, NULL);
+    gst_element_sync_state_with_parent (capsfilter);
+    gst_element_sync_state_with_parent (parse);
+  } else {
+    gst_element_link (queue, sink);
+    media_file_audio = TRUE;
+  }
+  gst_element_sync_state_with_parent (sink);
+  gst_element_sync_state_with_parent (queue);
+
+  sinkpad = gst_element_get_static_pad (queue, "sink");
+  gst_pad_link (pad, sinkpad);
+  gst_object_unref (sinkpad);
+}
+
+/* Loop from the start without flushing, so the running time keeps going */
+static gboolean
+on_media_reader_message (GstBus * bus, GstMessage * msg, gpointer user_data)
+{
+  GError *error = NULL;
+
+  switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_SEGMENT_DONE:
+      gst_element_seek (media_reader, 1.0, GST_FORMAT_TIME,
+          GST_SEEK_FLAG_SEGMENT, GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, -1);
+      break;
+    case GST_MESSAGE_ERROR:
+      gst_message_parse_error (msg, &error, NULL);
+      gst_printerr ("Media file error: %s\n", error->message);
+      g_error_free (error);
+      break;
+    default:
+      break;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/* Start reading --media-file, for as long as we run. It's read in real time
+ * whether or not a session is watching, so they all see the same stream. */
+static gboolean
+start_media_reader (void)
+{
+  GstElement *filesrc, *parsebin;
+  GstBus *bus;
+
+  media_reader = gst_pipeline_new ("media-reader");
+  media_file_gop = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gst_sample_unref);
+  filesrc = gst_element_factory_make ("filesrc", NULL);
+  parsebin = gst_element_factory_make ("parsebin", NULL);
+  g_object_set (filesrc, "location", media_file, NULL);
+  gst_bin_add_many (GST_BIN (media_reader), filesrc, parsebin, NULL);
+  gst_element_link (filesrc, parsebin);
+  g_signal_connect (parsebin, "pad-added",
+      G_CALLBACK (on_media_reader_pad_added), NULL);
+
+  bus = gst_pipeline_get_bus (GST_PIPELINE (media_reader));
+  gst_bus_add_watch (bus, on_media_reader_message, NULL);
+  gst_object_unref (bus);
+
+  /* The segment seek gets us SEGMENT_DONE instead of EOS at the end */
+  gst_element_set_state (media_reader, GST_STATE_PAUSED);
+  if (gst_element_get_state (media_reader, NULL, NULL,
+          10 * GST_SECOND) != GST_STATE_CHANGE_SUCCESS ||
+      !gst_element_seek (media_reader, 1.0, GST_FORMAT_TIME,
+          GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_SEGMENT, GST_SEEK_TYPE_SET, 0,
+          GST_SEEK_TYPE_NONE, -1)) {
+    gst_printerr ("Can't stream %s, it needs H.264 video\n", media_file);
+    gst_element_set_state (media_reader, GST_STATE_NULL);
+    g_clear_object (&media_reader);
+    return FALSE;
+  }
+  gst_element_set_state (media_reader, GST_STATE_PLAYING);
+  return TRUE;
+}
+
+/* An IDR can be 10-20 times the size of a P-frame, a burst the network may
+ * well drop. With intra refresh, after the first IDR a column of intra
+ * macroblocks sweeps across the picture once every INTRA_REFRESH_FRAMES
+ * frames instead, and the VBV is one frame interval, which is then as large
+ * as any frame gets. Keyframe requests start a new sweep rather than
+ * sending an IDR. */
+#define INTRA_REFRESH_FRAMES 25
+
+static void
+configure_rate_control (GstElement * x264enc)
+{
+  if (!session_config.intra_refresh)
+    return;
+  g_object_set (x264enc, "intra-refresh", TRUE,
+      "key-int-max", INTRA_REFRESH_FRAMES,
+      /* ms, at the 25 fps of INPUT_CAPS */
+      "vbv-buf-capacity", 1000 / 25, NULL);
+  gst_print ("send_video_to_browser() intra refresh every %d frames\n",
+      INTRA_REFRESH_FRAMES);
+}
+
+/* Payloads the H.264 coming out of @encoded in @bin and sends it to the
+ * browser */
+static void send_encoded_video_to_browser(GstElement* bin, GstElement* encoded,
+    GstCaps* encodeCaps) {
+  GstElement* queue2 = stage_queue();
+
+  GstElement* h264parse = gst_element_factory_make("h264parse", NULL);
+  GstElement* rtph264pay = gst_element_factory_make("rtph264pay", "pay");
+  g_object_set(rtph264pay, "config-interval", session_config.config_interval, NULL);
+  gst_util_set_object_arg(G_OBJECT(rtph264pay), "aggregate-mode", session_config.aggregate_mode);
+  guint mtu;
+
+  g_object_set(rtph264pay, "mtu", session_config.mtu, NULL);
+  g_object_get(rtph264pay, "mtu", &mtu, NULL);
+  gst_print ("send_video_to_browser() MTU %u, aggregate-mode %s, config-interval %d\n",
+      mtu, session_config.aggregate_mode, session_config.config_interval);
+
+
+  // the pacer waits in this queue's thread
+  GstElement* queue3 = pace_video ? gst_element_factory_make("queue", NULL)
+      : stage_queue();
+  if (pace_video) {
+    // bounded in time, so a source faster than the pacer can't add latency
+    // without end
+    g_object_set(queue3, "max-size-buffers", 0, "max-size-bytes", 0,
+        "max-size-time", (guint64) PACE_QUEUE_MAX, NULL);
+    gst_util_set_object_arg(G_OBJECT(queue3), "leaky", "downstream");
+  }
+
+  gst_bin_add_many(GST_BIN(bin), queue2, h264parse, rtph264pay, queue3, NULL);
+
+  gst_element_link_filtered(encoded, queue2, encodeCaps);
+  gst_element_link_many(queue2, h264parse, rtph264pay, NULL);
+
+  GstCaps* caps = gst_caps_from_string(RTP_VIDEO_H264_CAPS);
+  gst_element_link_filtered(rtph264pay, queue3, caps);
+
+  // expose queue3 src pad as the bin src
+  add_ghost_src(bin, queue3);
+
+  if (rtp_buffer_lists) {
+    GstPad *pad = gst_element_get_static_pad (rtph264pay, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+        GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) batch_probe,
+        g_new0 (GstBufferList *, 1), (GDestroyNotify) free_batch);
+    gst_object_unref (pad);
+  }
+  add_count_probe (queue3, "src", &metrics.video_out);
+  {
+    GstPad *pad = gst_element_get_static_pad (queue3, "src");
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+        GST_PAD_PROBE_TYPE_BUFFER_LIST, pace_probe, NULL, NULL);
+    gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_EVENT_FLUSH, pace_flush_probe,
+        NULL, NULL);
+    gst_object_unref (pad);
+    pace_resume ();
+  }
+
+  video_sink = send_media_to_browser(bin);
+
+  video_bin = bin;
+  schedule_latency_update ();
+}
+
+/* Where the next pre-encoded pattern frame goes, see on_pattern_need_data() */
+struct PatternReplay
+{
+  guint next;
+  GstClockTime pts;
+};
+
+/* Hands out the pre-encoded frames in a loop, timestamped from when this
+ * session's video started. They share the frames' memory. */
+static void
+on_pattern_need_data (GstElement * appsrc, guint length,
+    struct PatternReplay *replay)
+{
+  GstBuffer *frame = g_ptr_array_index (pattern_frames, replay->next);
+  GstBuffer *buffer = gst_buffer_copy (frame);
+  GstFlowReturn ret;
+
+  if (!GST_CLOCK_TIME_IS_VALID (replay->pts)) {
+    replay->pts = gst_element_get_current_running_time (appsrc);
+    if (!GST_CLOCK_TIME_IS_VALID (replay->pts))
+      replay->pts = 0;
+  }
+  GST_BUFFER_PTS (buffer) = GST_BUFFER_DTS (buffer) = replay->pts;
+  if (!GST_BUFFER_DURATION_IS_VALID (buffer))
+    GST_BUFFER_DURATION (buffer) = PATTERN_FRAME_DURATION;
+  GST_BUFFER_FLAG_UNSET (buffer, GST_BUFFER_FLAG_DISCONT);
+  replay->pts += GST_BUFFER_DURATION (buffer);
+  replay->next = (replay->next + 1) % pattern_frames->len;
+
+  g_signal_emit_by_name (appsrc, "push-buffer", buffer, &ret);
+  gst_buffer_unref (buffer);
+}
+
+/* The test pattern from pattern_frames, paced by clocksync */
+static gboolean send_pattern_to_browser(void) {
+  struct PatternReplay *replay = g_new0 (struct PatternReplay, 1);
+
+  GstElement* appsrc = gst_element_factory_make("appsrc", NULL);
+  GstCaps* encodeCaps = gst_caps_from_string(VIDEO_H264_CAPS
+      ", stream-format=byte-stream, alignment=au");
+  g_object_set(appsrc, "is-live", TRUE, "format", GST_FORMAT_TIME,
+      "caps", encodeCaps, NULL);
+  replay->pts = GST_CLOCK_TIME_NONE;
+  g_object_set_data_full (G_OBJECT (appsrc), "replay", replay, g_free);
+  g_signal_connect (appsrc, "need-data", G_CALLBACK (on_pattern_need_data),
+      replay);
+
+  GstElement* clocksync = gst_element_factory_make("clocksync", NULL);
+
+  GstElement* bin = gst_bin_new("video-to-browser");
+  gst_bin_add_many(GST_BIN(bin), appsrc, clocksync, NULL);
+  gst_element_link(appsrc, clocksync);
+
+  send_encoded_video_to_browser(bin, clocksync, encodeCaps);
+  gst_caps_unref(encodeCaps);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean send_video_to_browser(enum AppVideoSource source) {
+  gst_print ("send_video_to_browser() source: %s\n", video_source_to_string(source));
+
+  if(source == VIDEO_SOURCE_TEST_PATTERN && pattern_frames)
+    return send_pattern_to_browser();
+
+  if(source == VIDEO_SOURCE_FILE) {
+    if(!media_reader) {
+      gst_printerr ("No --media-file, sending the test pattern\n");
+      return send_video_to_browser(VIDEO_SOURCE_TEST_PATTERN);
+    }
+    GstElement* appsrc = media_file_source();
+    GstElement* bin = gst_bin_new("video-to-browser");
+    gst_bin_add(GST_BIN(bin), appsrc);
+    send_encoded_video_to_browser(bin, appsrc, NULL);
+    media_file_subscribe(appsrc, TRUE);
+    return G_SOURCE_REMOVE;
+  }
+
+  GstElement *videosrc = NULL, *shmsrc=NULL;
+
+  if(source == VIDEO_SOURCE_TEST_PATTERN) {
     videosrc = gst_element_factory_make("videotestsrc", NULL);
     g_object_set(videosrc, "pattern", 18, NULL);
     g_object_set(videosrc, "is-live", 1, NULL);
@@ -571,12 +2414,17 @@ static gboolean send_video_to_browser(enum AppVideoSource source) {
   if(source == VIDEO_SOURCE_LOOPBACK) {
     shmsrc = gst_element_factory_make("shmsrc", NULL);
     g_object_set(shmsrc, "socket-path", "/tmp/gst-send-recv", "do-timestamp", 1, NULL);
+    if (low_latency_loopback)
+      g_object_set(shmsrc, "is-live", TRUE, NULL);
     videosrc = gst_element_factory_make("videoparse", NULL);
     g_object_set(videosrc, "width", 640, "height", 480, "format", 2, NULL);
   }
 
 
-  GstElement* videorate = gst_element_factory_make("videorate", NULL);
+  // videorate holds on to a frame until it sees the next, the loopback is
+  // already at the rate of INPUT_CAPS
+  GstElement* videorate = gst_element_factory_make(
+      low_latency_loopback && shmsrc ? "identity" : "videorate", NULL);
   GstElement* videoscale = gst_element_factory_make("videoscale", NULL);
   GstElement* videoconvert = gst_element_factory_make("videoconvert", NULL);
 
@@ -584,35 +2432,21 @@ static gboolean send_video_to_browser(enum AppVideoSource source) {
   g_object_set(queue1, "max-size-buffers", 1, NULL);
 
   GstElement* x264enc = gst_element_factory_make("x264enc", NULL);
-  g_object_set(x264enc, "bitrate", 800, NULL);
+  g_object_set(x264enc, "bitrate", VIDEO_BITRATE, NULL);
   g_object_set(x264enc, "speed-preset", 1 /* ultrafast */, NULL);
   g_object_set(x264enc, "tune", 4 /* zerolatency */, NULL);
 
   // chrome seems happy with threads=1 or 2, but not 3+ (freeze on first keyframe)
   // doesn't seem to affect behaviour, so just 1 thread for safety
   g_object_set(x264enc, "threads", 1, NULL);
-
-  GstElement* queue2 = gst_element_factory_make("queue", NULL);
-
-  GstElement* h264parse = gst_element_factory_make("h264parse", NULL);
-  GstElement* rtph264pay = gst_element_factory_make("rtph264pay", NULL);
-  g_object_set(rtph264pay, "config-interval", -1, NULL);
-  g_object_set(rtph264pay, "aggregate-mode", 1 /* "zero-latency" */, NULL);
-  guint mtu;
-
-  g_object_set(rtph264pay, "mtu", 1300, NULL);
-  g_object_get(rtph264pay, "mtu", &mtu, NULL);
-
-
-  GstElement* queue3 = gst_element_factory_make("queue", NULL);
+  configure_rate_control(x264enc);
 
   GstCaps* inputCaps = gst_caps_from_string(INPUT_CAPS);
   GstCaps* encodeCaps = gst_caps_from_string(VIDEO_H264_CAPS);
 
   GstElement* bin = gst_bin_new("video-to-browser");
 
-  gst_bin_add_many(GST_BIN(bin), videosrc, videorate, videoscale, videoconvert, queue1, x264enc, queue2, h264parse,
-                   rtph264pay, queue3, NULL);
+  gst_bin_add_many(GST_BIN(bin), videosrc, videorate, videoscale, videoconvert, queue1, x264enc, NULL);
 
   if(shmsrc) {
     gst_bin_add(GST_BIN(bin), shmsrc);
@@ -622,39 +2456,43 @@ static gboolean send_video_to_browser(enum AppVideoSource source) {
   gst_element_link_many(videosrc, videorate, videoscale, NULL);
   gst_element_link_filtered(videoscale, videoconvert, inputCaps);
   gst_element_link_many(videoconvert, queue1, x264enc, NULL);
-  gst_element_link_filtered(x264enc, queue2, encodeCaps);
-  gst_element_link_many(queue2, h264parse, rtph264pay, NULL);
 
-  GstCaps* caps = gst_caps_from_string(RTP_VIDEO_H264_CAPS);
-  gst_element_link_filtered(rtph264pay, queue3, caps);
+  add_encoder_probes (x264enc);
+  if (shmsrc)
+    add_loopback_probe (queue1, loopback_out_probe);
 
-  // expose queue3 src pad as the bin src
-  add_ghost_src(bin, queue3);
-
-  video_sink = send_media_to_browser(bin);
-
-  video_bin = bin;
+  send_encoded_video_to_browser(bin, x264enc, encodeCaps);
   return G_SOURCE_REMOVE;
 }
 
 
 static gboolean stop_video_to_browser() {
   gst_print ("stop_video_to_browser()\n");
+  // don't leave the pacer waiting while the bin shuts down
+  pace_unschedule();
   stop_media_to_browser(video_bin, video_sink);
   video_sink = NULL;
   video_bin = NULL;
+  schedule_latency_update ();
   return G_SOURCE_REMOVE;
 }
 
 static gboolean send_audio_to_browser() {
   gst_print ("send_audio_to_browser()\n");
 
-  GstElement* testaudiosrc = gst_element_factory_make("audiotestsrc", NULL);
-  g_object_set(testaudiosrc, "wave", 10, NULL); // Red noise
+  GstElement *testaudiosrc, *opusenc;
 
-  GstElement* opusenc = gst_element_factory_make("opusenc", NULL);
+  if (media_file_audio) {
+    // The file's Opus as it is
+    testaudiosrc = media_file_source();
+    opusenc = gst_element_factory_make("identity", NULL);
+  } else {
+    testaudiosrc = gst_element_factory_make("audiotestsrc", NULL);
+    g_object_set(testaudiosrc, "wave", 10, NULL); // Red noise
+    opusenc = gst_element_factory_make("opusenc", NULL);
+  }
   GstElement* rtpopuspay = gst_element_factory_make("rtpopuspay", NULL);
-  GstElement* queue = gst_element_factory_make("queue", NULL);
+  GstElement* queue = stage_queue();
 
   GstElement* bin = gst_bin_new("audio-to-browser");
 
@@ -666,9 +2504,25 @@ static gboolean send_audio_to_browser() {
 
   // expose queue3 src pad as the bin src
   add_ghost_src(bin, queue);
+  add_count_probe (queue, "src", &metrics.audio_out);
 
   audio_sink = send_media_to_browser(bin);
   audio_bin = bin;
+  if (pace_video) {
+    // audio isn't paced, and gets the higher DSCP marking
+    GstWebRTCRTPTransceiver *transceiver;
+    GstWebRTCRTPSender *sender = NULL;
+    g_object_get(audio_sink, "transceiver", &transceiver, NULL);
+    g_object_get(transceiver, "sender", &sender, NULL);
+    if (sender && g_object_class_find_property(G_OBJECT_GET_CLASS(sender), "priority"))
+      g_object_set(sender, "priority", GST_WEBRTC_PRIORITY_TYPE_HIGH, NULL);
+    if (sender)
+      gst_object_unref(sender);
+    gst_object_unref(transceiver);
+  }
+  if (media_file_audio)
+    media_file_subscribe(testaudiosrc, FALSE);
+  schedule_latency_update ();
   return G_SOURCE_REMOVE;
 }
 
@@ -677,9 +2531,131 @@ static gboolean stop_audio_to_browser() {
   stop_media_to_browser(audio_bin, audio_sink);
   audio_bin = NULL;
   audio_sink = NULL;
+  schedule_latency_update ();
   return G_SOURCE_REMOVE;
 }
 
+/* Tell the browser about something that happened in the pipeline, as
+ * "EVENT {json}" on the data channel */
+static void
+send_pipeline_event (const gchar * type, GstObject * src, const gchar * text,
+    const gchar * action)
+{
+  JsonObject *event;
+  gchar *path, *json, *msg;
+
+  if (!data_channel)
+    return;
+
+  event = json_object_new ();
+  json_object_set_string_member (event, "type", type);
+  path = gst_object_get_path_string (src);
+  json_object_set_string_member (event, "source", path);
+  g_free (path);
+  if (text)
+    json_object_set_string_member (event, "message", text);
+  if (action)
+    json_object_set_string_member (event, "action", action);
+  json = get_string_from_json_object (event);
+  json_object_unref (event);
+
+  msg = g_strdup_printf ("EVENT %s", json);
+  g_signal_emit_by_name (data_channel, "send-string", msg);
+  g_free (msg);
+  g_free (json);
+}
+
+static void
+count_qos (GstMessage * msg)
+{
+  GstFormat format;
+  guint64 processed, dropped, *last;
+  gchar *path;
+
+  gst_message_parse_qos_stats (msg, &format, &processed, &dropped);
+  metrics.qos_messages++;
+  if (dropped == (guint64) - 1)
+    return;
+
+  path = gst_object_get_path_string (GST_MESSAGE_SRC (msg));
+  last = g_hash_table_lookup (qos_dropped, path);
+  if (!last) {
+    last = g_new0 (guint64, 1);
+    g_hash_table_insert (qos_dropped, path, last);
+  } else {
+    g_free (path);
+  }
+  if (dropped > *last)
+    metrics.qos_dropped += dropped - *last;
+  *last = dropped;
+}
+
+/* Errors in one of the streams we send stop that stream, the rest of the
+ * session carries on. Anything else ends the session. */
+static gboolean
+on_bus_message (GstBus * bus, GstMessage * msg, gpointer user_data)
+{
+  GstObject *src = GST_MESSAGE_SRC (msg);
+  GError *error = NULL;
+  gchar *debug = NULL;
+  const gchar *action;
+  GstElement *branch;
+
+  switch (GST_MESSAGE_TYPE (msg)) {
+    case GST_MESSAGE_ERROR:
+      gst_message_parse_error (msg, &error, &debug);
+      /* Left over from a branch we already stopped */
+      if (!gst_object_has_as_ancestor (src, GST_OBJECT (pipe1)))
+        break;
+      metrics.errors++;
+      gst_printerr ("Error from %s: %s\n", GST_OBJECT_NAME (src),
+          error->message);
+      if (debug)
+        gst_printerr ("%s\n", debug);
+
+      if (video_bin && gst_object_has_as_ancestor (src,
+              GST_OBJECT (video_bin))) {
+        action = "video stopped";
+        stop_video_to_browser ();
+      } else if (audio_bin && gst_object_has_as_ancestor (src,
+              GST_OBJECT (audio_bin))) {
+        action = "audio stopped";
+        stop_audio_to_browser ();
+      } else if ((branch = receive_branch_of (src))) {
+        action = "receiving stopped";
+        stop_receive_branch (branch);
+      } else {
+        send_pipeline_event ("error", src, error->message, "session ended");
+        cleanup_and_quit_loop ("Pipeline error", PEER_CALL_ERROR);
+        break;
+      }
+      send_pipeline_event ("error", src, error->message, action);
+      break;
+    case GST_MESSAGE_WARNING:
+      gst_message_parse_warning (msg, &error, &debug);
+      metrics.warnings++;
+      gst_printerr ("Warning from %s: %s\n", GST_OBJECT_NAME (src),
+          error->message);
+      send_pipeline_event ("warning", src, error->message, NULL);
+      break;
+    case GST_MESSAGE_QOS:
+      count_qos (msg);
+      break;
+    case GST_MESSAGE_LATENCY:
+      /* Branches come and go, their latency with them. measure_latency()
+       * recalculates it before querying the branches. */
+      send_pipeline_event ("latency", src, NULL, "latency changed");
+      schedule_latency_update ();
+      break;
+    default:
+      break;
+  }
+
+  g_clear_error (&error);
+  g_free (debug);
+  return G_SOURCE_CONTINUE;
+}
+
 static void
 data_channel_on_error (GObject * dc, gpointer user_data)
 {
@@ -710,6 +2686,8 @@ data_channel_on_open (GObject * dc, gpointer user_data)
 {
   gst_print ("data channel opened\n");
   ping_count = 0;
+  if (!data_channel)
+    data_channel = g_object_ref (dc);
   if(g_source_data_channel_ping_timeout == 0) { // For some reason on_open gets called twice, this stops us setting up a duplicate timeout
     g_source_data_channel_ping_timeout = g_timeout_add (2000, (GSourceFunc) data_channel_send_hello, dc);
   }
@@ -717,11 +2695,97 @@ data_channel_on_open (GObject * dc, gpointer user_data)
   g_idle_add((GSourceFunc)dump_graph, NULL);
 }
 
+/* Applies to the running video payloader, and to video started later on in
+ * this session. Returns an error message, or NULL. Main loop only, that's
+ * where video_bin changes. */
+static const gchar *
+apply_session_setting (const gchar * key, const gchar * value)
+{
+  GstElement *pay = video_bin ? gst_bin_get_by_name (GST_BIN (video_bin), "pay")
+      : NULL;
+  const gchar *error = NULL;
+  gchar *end;
+  gint64 n = g_ascii_strtoll (value, &end, 10);
+  gboolean is_int = *value && !*end;
+
+  if (g_str_equal (key, "mtu")) {
+    if (!is_int || n < 100 || n > 65000) {
+      error = "mtu must be between 100 and 65000";
+    } else {
+      session_config.mtu = n;
+      if (pay)
+        g_object_set (pay, "mtu", (guint) n, NULL);
+    }
+  } else if (g_str_equal (key, "aggregate-mode")) {
+    if (!g_str_equal (value, "none") && !g_str_equal (value, "zero-latency")
+        && !g_str_equal (value, "max")) {
+      error = "aggregate-mode must be none, zero-latency or max";
+    } else {
+      g_free (session_config.aggregate_mode);
+      session_config.aggregate_mode = g_strdup (value);
+      if (pay)
+        gst_util_set_object_arg (G_OBJECT (pay), "aggregate-mode", value);
+    }
+  } else if (g_str_equal (key, "config-interval")) {
+    if (!is_int || n < -1 || n > 3600) {
+      error = "config-interval must be between -1 and 3600";
+    } else {
+      session_config.config_interval = n;
+      if (pay)
+        g_object_set (pay, "config-interval", (gint) n, NULL);
+    }
+  } else if (g_str_equal (key, "rate-control")) {
+    /* x264enc only takes this when it starts */
+    if (g_str_equal (value, "intra-refresh"))
+      session_config.intra_refresh = TRUE;
+    else if (g_str_equal (value, "idr"))
+      session_config.intra_refresh = FALSE;
+    else
+      error = "rate-control must be idr or intra-refresh";
+  } else if (g_str_equal (key, "mtu-from-pair")) {
+    session_config.mtu_from_pair = g_str_equal (value, "1")
+        || g_str_equal (value, "true");
+  } else {
+    error = "unknown setting";
+  }
+
+  if (pay)
+    gst_object_unref (pay);
+  return error;
+}
+
+/* "SET <key> <value>" from the data channel, on the main loop */
+static gboolean
+apply_set_message (const gchar * str)
+{
+  gchar **args = g_strsplit (str + strlen ("SET "), " ", 2);
+  const gchar *error = "usage: SET <key> <value>";
+  gchar *reply;
+
+  if (g_strv_length (args) == 2)
+    error = apply_session_setting (args[0], args[1]);
+  if (error)
+    reply = g_strdup_printf ("ERROR %s", error);
+  else
+    reply = g_strdup_printf ("SET %s %s OK", args[0], args[1]);
+  if (data_channel)
+    g_signal_emit_by_name (data_channel, "send-string", reply);
+  g_free (reply);
+  g_strfreev (args);
+  return G_SOURCE_REMOVE;
+}
+
 static void
 data_channel_on_message_string (GObject * dc, gchar * str, gpointer user_data)
 {
   gst_print ("Received data channel message: %s\n", str);
 
+  if (g_str_has_prefix (str, "SET ")) {
+    g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT_IDLE,
+        (GSourceFunc) apply_set_message, g_strdup (str), g_free);
+    return;
+  }
+
   if(g_strcmp0(str, "RECV VIDEO START TESTPATTERN") == 0) {
     // Just calling send_video_to_browser directly from this context doesn't work
     // so schedule an event to do it for us.
@@ -732,6 +2796,9 @@ data_channel_on_message_string (GObject * dc, gchar * str, gpointer user_data)
     // so schedule an event to do it for us.
     g_idle_add((GSourceFunc) send_video_to_browser, (void*)VIDEO_SOURCE_LOOPBACK);
   }
+  if(g_strcmp0(str, "RECV VIDEO START FILE") == 0) {
+    g_idle_add((GSourceFunc) send_video_to_browser, (void*)VIDEO_SOURCE_FILE);
+  }
   if(g_strcmp0(str, "RECV VIDEO STOP") == 0) {
     g_idle_add ((GSourceFunc) stop_video_to_browser, NULL);
   }
@@ -741,51 +2808,303 @@ data_channel_on_message_string (GObject * dc, gchar * str, gpointer user_data)
   if(g_strcmp0(str, "RECV AUDIO STOP") == 0) {
     g_idle_add ((GSourceFunc) stop_audio_to_browser, NULL);
   }
-}
+}
+
+
+
+static void
+connect_data_channel_signals (GObject * data_channel)
+{
+  g_signal_connect (data_channel, "on-error",
+      G_CALLBACK (data_channel_on_error), NULL);
+  g_signal_connect (data_channel, "on-open", G_CALLBACK (data_channel_on_open),
+      NULL);
+  g_signal_connect (data_channel, "on-close",
+      G_CALLBACK (data_channel_on_close), NULL);
+  g_signal_connect (data_channel, "on-message-string",
+      G_CALLBACK (data_channel_on_message_string), NULL);
+}
+
+static void
+on_data_channel (GstElement * webrtc, GObject * data_channel,
+    gpointer user_data)
+{
+  gst_print ("on_data_channel\n");
+  connect_data_channel_signals (data_channel);
+}
+
+static gboolean whip_send_answer (void);
+
+static void
+on_ice_gathering_state_notify (GstElement * webrtcbin, GParamSpec * pspec,
+    gpointer user_data)
+{
+  GstWebRTCICEGatheringState ice_gather_state;
+  const gchar *new_state = "unknown";
+
+  g_object_get (webrtcbin, "ice-gathering-state", &ice_gather_state, NULL);
+  switch (ice_gather_state) {
+    case GST_WEBRTC_ICE_GATHERING_STATE_NEW:
+      new_state = "new";
+      break;
+    case GST_WEBRTC_ICE_GATHERING_STATE_GATHERING:
+      new_state = "gathering";
+      metrics.gathering_start = g_get_monotonic_time ();
+      break;
+    case GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE:
+      new_state = "complete";
+      metrics.gathering_done = g_get_monotonic_time ();
+      break;
+  }
+  gst_print ("ICE gathering state changed to %s\n", new_state);
+
+  if (metrics.gathering_done && metrics.gathering_start) {
+    GString *ports = g_string_new (NULL);
+    guint i;
+
+    for (i = 0; i < metrics.n_local_ports; i++)
+      g_string_append_printf (ports, " %u", metrics.local_ports[i]);
+    gst_print ("ICE gathering took %.1f ms, %u candidates sent, %u "
+        "filtered out, local ports:%s\n", metrics_ms (metrics.gathering_start,
+            metrics.gathering_done), metrics.candidates_sent,
+        metrics.candidates_dropped, ports->str);
+    g_string_free (ports, TRUE);
+  }
+
+  /* The WHIP/WHEP answer now has all our candidates */
+  if (ice_gather_state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE && whip_msg)
+    g_idle_add ((GSourceFunc) whip_send_answer, NULL);
+}
+
+static void
+on_ice_connection_state_notify (GstElement * webrtcbin, GParamSpec * pspec,
+    gpointer user_data)
+{
+  GstWebRTCICEConnectionState state;
+
+  g_object_get (webrtcbin, "ice-connection-state", &state, NULL);
+  switch (state) {
+    case GST_WEBRTC_ICE_CONNECTION_STATE_CHECKING:
+      metrics.checking_start = g_get_monotonic_time ();
+      gst_print ("ICE connectivity checks started\n");
+      break;
+    case GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED:
+    case GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED:
+      if (metrics.ice_connected)
+        break;
+      metrics.ice_connected = g_get_monotonic_time ();
+      gst_print ("ICE connected after %.1f ms of checks, %.1f ms after "
+          "the pipeline started\n", metrics.checking_start ?
+          metrics_ms (metrics.checking_start, metrics.ice_connected) : 0.0,
+          metrics_ms (metrics.start, metrics.ice_connected));
+      break;
+    case GST_WEBRTC_ICE_CONNECTION_STATE_FAILED:
+      gst_printerr ("ICE failed\n");
+      break;
+    default:
+      break;
+  }
+}
+
+/* The selected pair is relayed, make room for TURN's headers */
+static gboolean
+lower_relay_mtu (void)
+{
+  GstElement *pay;
+
+  /* Only once per session, the pair can change more than once. Lowered
+   * from whatever the session set, not just the default. */
+  if (!session_config.mtu_from_pair || relay_mtu_lowered)
+    return G_SOURCE_REMOVE;
+  relay_mtu_lowered = TRUE;
+  session_config.mtu -= RELAY_MTU_OVERHEAD;
+  gst_print ("Relayed pair, video MTU now %d\n", session_config.mtu);
+  pay = video_bin ? gst_bin_get_by_name (GST_BIN (video_bin), "pay") : NULL;
+  if (pay) {
+    g_object_set (pay, "mtu", (guint) session_config.mtu, NULL);
+    gst_object_unref (pay);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+/* From libnice, with the foundations of the pair it picked for media */
+static void
+on_new_selected_pair (GObject * agent, guint stream_id, guint component_id,
+    const gchar * lfoundation, const gchar * rfoundation, gpointer user_data)
+{
+  gchar *lkey = g_strconcat ("L:", lfoundation, NULL);
+  gchar *rkey = g_strconcat ("R:", rfoundation, NULL);
+  gchar *local, *remote;
+  gboolean relayed;
+
+  g_mutex_lock (&candidate_kinds_lock);
+  local = candidate_kinds ?
+      g_strdup (g_hash_table_lookup (candidate_kinds, lkey)) : NULL;
+  remote = candidate_kinds ?
+      g_strdup (g_hash_table_lookup (candidate_kinds, rkey)) : NULL;
+  g_mutex_unlock (&candidate_kinds_lock);
+  relayed = g_str_has_prefix (local ? local : "", "relay")
+      || g_str_has_prefix (remote ? remote : "", "relay");
+
+  gst_print ("Selected ICE pair: local %s, remote %s\n",
+      local ? local : "unknown", remote ? remote : "unknown");
+
+  /* We're on libnice's thread, session_config and video_bin belong to the
+   * main loop */
+  if (relayed)
+    g_main_context_invoke (NULL, (GSourceFunc) lower_relay_mtu, NULL);
+
+  g_free (local);
+  g_free (remote);
+  g_free (lkey);
+  g_free (rkey);
+}
+
+static void
+on_connection_state_notify (GstElement * webrtcbin, GParamSpec * pspec,
+    gpointer user_data)
+{
+  GstWebRTCPeerConnectionState state;
+
+  g_object_get (webrtcbin, "connection-state", &state, NULL);
+  if (state != GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED
+      || metrics.dtls_connected)
+    return;
+
+  metrics.dtls_connected = g_get_monotonic_time ();
+  gst_print ("DTLS handshake done %.1f ms after ICE connected, %.1f ms after "
+      "the pipeline started\n", metrics.ice_connected ?
+      metrics_ms (metrics.ice_connected, metrics.dtls_connected) : 0.0,
+      metrics_ms (metrics.start, metrics.dtls_connected));
+}
+
+static GstPadProbeReturn
+first_media_probe (GstPad * pad, GstPadProbeInfo * info, gint64 * first)
+{
+  /* Another pad got there first */
+  if (*first)
+    return GST_PAD_PROBE_REMOVE;
+  /* On the way out, DTLS handshake packets go through too */
+  if (first == &metrics.first_media_out && !metrics.dtls_connected)
+    return GST_PAD_PROBE_OK;
+
+  *first = g_get_monotonic_time ();
+  gst_print ("First media %s %.1f ms after the pipeline started\n",
+      first == &metrics.first_media_in ? "received" : "sent",
+      metrics_ms (metrics.start, *first));
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+add_first_media_probe (GstPad * pad, gint64 * first)
+{
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) first_media_probe,
+      first, NULL);
+}
+
+/* (Re)load --dtls-cert if it changed since we last read it, so it can be
+ * rotated by replacing the file. Returns NULL to use the certificate dtlsdec
+ * generates itself. */
+static const gchar *
+get_dtls_pem (void)
+{
+  GStatBuf st;
+  GError *error = NULL;
+  gchar *pem;
+
+  if (!dtls_cert)
+    return NULL;
+
+  if (g_stat (dtls_cert, &st) != 0) {
+    gst_printerr ("Can't stat %s, keeping the current DTLS certificate\n",
+        dtls_cert);
+    return dtls_pem;
+  }
+  if (dtls_pem && st.st_mtime == dtls_pem_mtime)
+    return dtls_pem;
 
+  if (!g_file_get_contents (dtls_cert, &pem, NULL, &error)) {
+    gst_printerr ("Can't read %s (%s), keeping the current DTLS "
+        "certificate\n", dtls_cert, error->message);
+    g_error_free (error);
+    return dtls_pem;
+  }
 
+  g_free (dtls_pem);
+  dtls_pem = pem;
+  dtls_pem_mtime = st.st_mtime;
+  gst_print ("Loaded DTLS certificate from %s\n", dtls_cert);
+  return dtls_pem;
+}
 
+/* dtlsdec generates its certificate the first time it's needed and keeps it
+ * for the whole process, as it does for each PEM it's given. Get that out of
+ * the way now rather than during the first call. */
 static void
-connect_data_channel_signals (GObject * data_channel)
+prewarm_dtls (void)
 {
-  g_signal_connect (data_channel, "on-error",
-      G_CALLBACK (data_channel_on_error), NULL);
-  g_signal_connect (data_channel, "on-open", G_CALLBACK (data_channel_on_open),
-      NULL);
-  g_signal_connect (data_channel, "on-close",
-      G_CALLBACK (data_channel_on_close), NULL);
-  g_signal_connect (data_channel, "on-message-string",
-      G_CALLBACK (data_channel_on_message_string), NULL);
+  GstElement *dtlsdec = gst_element_factory_make ("dtlsdec", NULL);
+  gint64 start = g_get_monotonic_time ();
+  const gchar *pem = get_dtls_pem ();
+
+  if (pem)
+    g_object_set (dtlsdec, "pem", pem, NULL);
+  gst_object_unref (dtlsdec);
+  gst_print ("DTLS certificate ready in %.1f ms\n",
+      metrics_ms (start, g_get_monotonic_time ()));
 }
 
 static void
-on_data_channel (GstElement * webrtc, GObject * data_channel,
-    gpointer user_data)
+configure_webrtc_element (GstElement * element, const gchar * pem)
 {
-  gst_print ("on_data_channel\n");
-  connect_data_channel_signals (data_channel);
+  GstElementFactory *factory = gst_element_get_factory (element);
+  const gchar *name;
+
+  if (!factory)
+    return;
+  name = gst_plugin_feature_get_name (factory);
+
+  if (pem && g_str_equal (name, "dtlssrtpdec")) {
+    gchar *connection_id = NULL;
+
+    /* webrtcbin already gave it its connection-id, and the DTLS connection
+     * made then uses the generated certificate. Make it again with ours, or
+     * the handshake wouldn't match the fingerprint in the SDP, which comes
+     * from the pem. */
+    g_object_get (element, "connection-id", &connection_id, NULL);
+    g_object_set (element, "pem", pem, NULL);
+    if (connection_id)
+      g_object_set (element, "connection-id", connection_id, NULL);
+    g_free (connection_id);
+  } else if (g_str_equal (name, "nicesink")) {
+    GstPad *sink = gst_element_get_static_pad (element, "sink");
+    add_first_media_probe (sink, &metrics.first_media_out);
+    gst_object_unref (sink);
+  }
 }
 
+/* webrtcbin adds its transport bins with their elements already inside, so
+ * look into whatever bin gets added too */
 static void
-on_ice_gathering_state_notify (GstElement * webrtcbin, GParamSpec * pspec,
+on_deep_element_added (GstBin * bin, GstBin * sub_bin, GstElement * element,
     gpointer user_data)
 {
-  GstWebRTCICEGatheringState ice_gather_state;
-  const gchar *new_state = "unknown";
+  const gchar *pem = user_data;
+  GstIterator *it;
+  GValue item = G_VALUE_INIT;
 
-  g_object_get (webrtcbin, "ice-gathering-state", &ice_gather_state, NULL);
-  switch (ice_gather_state) {
-    case GST_WEBRTC_ICE_GATHERING_STATE_NEW:
-      new_state = "new";
-      break;
-    case GST_WEBRTC_ICE_GATHERING_STATE_GATHERING:
-      new_state = "gathering";
-      break;
-    case GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE:
-      new_state = "complete";
-      break;
+  configure_webrtc_element (element, pem);
+  if (!GST_IS_BIN (element))
+    return;
+
+  it = gst_bin_iterate_recurse (GST_BIN (element));
+  while (gst_iterator_next (it, &item) == GST_ITERATOR_OK) {
+    configure_webrtc_element (g_value_get_object (&item), pem);
+    g_value_reset (&item);
   }
-  gst_print ("ICE gathering state changed to %s\n", new_state);
+  g_value_unset (&item);
+  gst_iterator_free (it);
 }
 
 static gboolean webrtcbin_get_stats (GstElement * webrtcbin);
@@ -838,8 +3157,10 @@ static void on_local_description_set(GstPromise * promise, gpointer user_data) {
 
   GstWebRTCSessionDescription *answer = user_data;
 
-  /* Send answer to peer */
-  send_sdp_to_peer (answer);
+  /* Send answer to peer. WHIP/WHEP answers are sent once ICE gathering is
+   * complete instead, see whip_send_answer() */
+  if (ws_conn)
+    send_sdp_to_peer (answer);
   gst_webrtc_session_description_free (answer);
 }
 
@@ -893,10 +3214,233 @@ on_signaling_state_changed(GstElement* object, GParamSpec* pspec, gpointer user_
 }
 
 
-#define STUN_SERVER "stun://stun.l.google.com:19302"
 #define RTP_TWCC_URI "http://www.ietf.org/id/draft-holmer-rmcat-transport-wide-cc-extensions-01"
 #define RTP_PAYLOAD_TYPE "96"
 
+#ifdef __linux__
+/* Parses a "0-3,8" style CPU list */
+static gboolean
+parse_cpu_list (const gchar * list, cpu_set_t * set)
+{
+  gchar **ranges = g_strsplit (list, ",", -1), **range;
+  guint64 first, last;
+  gchar *end, *start;
+  gboolean ok = TRUE;
+
+  CPU_ZERO (set);
+  for (range = ranges; ok && *range; range++) {
+    first = last = g_ascii_strtoull (*range, &end, 10);
+    if (end == *range)
+      ok = FALSE;
+    else if (*end == '-') {
+      start = end + 1;
+      last = g_ascii_strtoull (start, &end, 10);
+      ok = end != start;
+    }
+    if (*end || last < first || last >= CPU_SETSIZE)
+      ok = FALSE;
+    for (; ok && first <= last; first++)
+      CPU_SET (first, set);
+  }
+  g_strfreev (ranges);
+  return ok && CPU_COUNT (set) > 0;
+}
+#endif
+
+/* Fills pattern_frames, from --test-pattern-file or by encoding a GOP of
+ * the same test pattern the live source shows */
+static gboolean
+load_test_pattern (void)
+{
+  GstElement *pipeline, *sink, *src;
+  GstSample *sample;
+  GstMessage *msg;
+  GstBus *bus;
+  GError *error = NULL;
+  gboolean eos = FALSE;
+  gchar *desc;
+
+  if (test_pattern_file) {
+    desc = g_strdup ("filesrc name=src ! h264parse ! " VIDEO_H264_CAPS
+        ", stream-format=byte-stream, alignment=au ! "
+        "appsink name=sink sync=false");
+  } else {
+    desc = g_strdup_printf ("videotestsrc pattern=18 num-buffers=%d ! "
+        INPUT_CAPS " ! x264enc bitrate=%d speed-preset=ultrafast "
+        "tune=zerolatency threads=1 key-int-max=%d ! " VIDEO_H264_CAPS
+        ", stream-format=byte-stream, alignment=au ! "
+        "appsink name=sink sync=false", PATTERN_FRAMES, VIDEO_BITRATE,
+        PATTERN_FRAMES);
+  }
+  pipeline = gst_parse_launch (desc, &error);
+  g_free (desc);
+  if (error) {
+    gst_printerr ("Failed to set up the test pattern: %s\n", error->message);
+    g_error_free (error);
+    g_clear_object (&pipeline);
+    return FALSE;
+  }
+
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  if (src) {
+    g_object_set (src, "location", test_pattern_file, NULL);
+    gst_object_unref (src);
+  }
+
+  pattern_frames = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gst_buffer_unref);
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  if (gst_element_set_state (pipeline,
+          GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+    /* Bounded, so a pipeline that errors out or stalls doesn't hang startup */
+    for (;;) {
+      g_signal_emit_by_name (sink, "try-pull-sample", 10 * GST_SECOND,
+          &sample);
+      if (!sample)
+        break;
+      g_ptr_array_add (pattern_frames,
+          gst_buffer_ref (gst_sample_get_buffer (sample)));
+      gst_sample_unref (sample);
+    }
+    g_object_get (sink, "eos", &eos, NULL);
+  }
+
+  if (!eos) {
+    bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
+    msg = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+    if (msg) {
+      gst_message_parse_error (msg, &error, NULL);
+      gst_printerr ("Failed to read the test pattern: %s\n", error->message);
+      g_error_free (error);
+      gst_message_unref (msg);
+    } else {
+      gst_printerr ("Failed to read the test pattern: no frames for 10 s\n");
+    }
+    gst_object_unref (bus);
+  }
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (pipeline);
+
+  if (!eos || pattern_frames->len == 0) {
+    if (eos)
+      gst_printerr ("The test pattern has no frames\n");
+    g_clear_pointer (&pattern_frames, g_ptr_array_unref);
+    return FALSE;
+  }
+  /* Every loop has to start with an IDR */
+  if (GST_BUFFER_FLAG_IS_SET (g_ptr_array_index (pattern_frames, 0),
+          GST_BUFFER_FLAG_DELTA_UNIT)) {
+    gst_printerr ("The test pattern doesn't start with an IDR\n");
+    g_clear_pointer (&pattern_frames, g_ptr_array_unref);
+    return FALSE;
+  }
+  gst_print ("Test pattern: %u frames pre-encoded\n", pattern_frames->len);
+  return TRUE;
+}
+
+static gboolean
+check_thread_placement (void)
+{
+#ifdef __linux__
+  if (encoder_cpus && !parse_cpu_list (encoder_cpus, &encoder_cpu_set)) {
+    gst_printerr ("Invalid --encoder-cpus %s\n", encoder_cpus);
+    return FALSE;
+  }
+  if (network_cpus && !parse_cpu_list (network_cpus, &network_cpu_set)) {
+    gst_printerr ("Invalid --network-cpus %s\n", network_cpus);
+    return FALSE;
+  }
+  /* Reused pool threads get this back when they run something unpinned */
+  sched_getaffinity (0, sizeof (all_cpu_set), &all_cpu_set);
+#else
+  if (encoder_cpus || network_cpus)
+    gst_printerr ("Thread pinning is only supported on Linux, ignoring\n");
+#endif
+  return TRUE;
+}
+
+/* What a streaming thread does: "enc" for a thread feeding the video
+ * encoder, so the one doing the encoding, "net" for webrtcbin's own (RTP, SRTP and
+ * nicesrc), otherwise which of our bins it's in. */
+static const gchar *
+stream_thread_role (GstElement * owner)
+{
+  GstPad *src = gst_element_get_static_pad (owner, "src");
+  GstPad *peer = src ? gst_pad_get_peer (src) : NULL;
+  GstElement *next = peer ? gst_pad_get_parent_element (peer) : NULL;
+  GstObject *obj, *parent;
+  GstElementFactory *factory;
+  const gchar *role = NULL;
+
+  if (next && strstr (gst_element_class_get_metadata (GST_ELEMENT_GET_CLASS
+              (next), GST_ELEMENT_METADATA_KLASS), "Encoder/Video"))
+    role = "enc";
+
+  /* By the bins it's in, not webrtc1/video_bin/audio_bin: we're on a
+   * streaming thread, and the main loop changes those */
+  for (obj = gst_object_ref (owner); obj && !role; obj = parent) {
+    factory = gst_element_get_factory (GST_ELEMENT (obj));
+    if (factory && g_str_equal (GST_OBJECT_NAME (factory), "webrtcbin"))
+      role = "net";
+    else if (g_str_equal (GST_OBJECT_NAME (obj), "video-to-browser"))
+      role = "video";
+    else if (g_str_equal (GST_OBJECT_NAME (obj), "audio-to-browser"))
+      role = "audio";
+    parent = gst_object_get_parent (obj);
+    gst_object_unref (obj);
+  }
+  if (obj)
+    gst_object_unref (obj);
+  if (!role)
+    role = "recv";
+
+  if (next)
+    gst_object_unref (next);
+  if (peer)
+    gst_object_unref (peer);
+  if (src)
+    gst_object_unref (src);
+  return role;
+}
+
+/* Called from the streaming thread itself as it enters its loop, so this is
+ * where to name and pin it. Threads libnice and webrtcbin start on their
+ * own, outside of GstTasks, don't post these. */
+static GstBusSyncReply
+on_stream_status (GstBus * bus, GstMessage * msg, gpointer user_data)
+{
+  GstStreamStatusType type;
+  GstElement *owner;
+  const gchar *role;
+  gchar name[16];
+
+  if (GST_MESSAGE_TYPE (msg) != GST_MESSAGE_STREAM_STATUS)
+    return GST_BUS_PASS;
+  gst_message_parse_stream_status (msg, &type, &owner);
+  if (type != GST_STREAM_STATUS_TYPE_ENTER)
+    return GST_BUS_PASS;
+
+  role = stream_thread_role (owner);
+  /* Linux thread names are at most 15 characters */
+  g_snprintf (name, sizeof (name), "s%u-%s%d", session_count, role,
+      g_atomic_int_add (&session_threads, 1));
+  GST_INFO ("Streaming thread %s for %s", name, GST_OBJECT_NAME (owner));
+
+#ifdef __linux__
+  pthread_setname_np (pthread_self (), name);
+  if (encoder_cpus || network_cpus) {
+    cpu_set_t *set = &all_cpu_set;
+    if (encoder_cpus && g_str_equal (role, "enc"))
+      set = &encoder_cpu_set;
+    else if (network_cpus && g_str_equal (role, "net"))
+      set = &network_cpu_set;
+    pthread_setaffinity_np (pthread_self (), sizeof (*set), set);
+  }
+#endif
+  return GST_BUS_PASS;
+}
+
 static gboolean
 start_pipeline ()
 {
@@ -906,14 +3450,89 @@ start_pipeline ()
   //  replaced gst_parse_launch with manual pipeline and webrtcbin
   // as don't want audio and video by default,
 
+  memset (&metrics, 0, sizeof (metrics));
+  metrics.start = g_get_monotonic_time ();
+  metrics.reported_cpu = process_cpu_time ();
+  g_mutex_lock (&thread_cpu_lock);
+  if (thread_cpu)
+    g_hash_table_remove_all (thread_cpu);
+  else
+    thread_cpu = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  g_mutex_unlock (&thread_cpu_lock);
+
+  g_free (session_config.aggregate_mode);
+  session_config = default_config;
+  session_config.aggregate_mode = g_strdup (default_config.aggregate_mode);
+  g_clear_pointer (&branch_latency, json_object_unref);
+  media_file_new_session ();
+  if (qos_dropped)
+    g_hash_table_remove_all (qos_dropped);
+  else
+    qos_dropped = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+        g_free);
+  g_mutex_lock (&candidate_kinds_lock);
+  if (candidate_kinds)
+    g_hash_table_remove_all (candidate_kinds);
+  else
+    candidate_kinds = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+        g_free);
+  g_mutex_unlock (&candidate_kinds_lock);
+  relay_mtu_lowered = FALSE;
+
   pipe1 = gst_pipeline_new("pipeline");
   g_assert_nonnull (pipe1);
+  session_count++;
+  session_threads = 0;
+  {
+    GstBus *bus = gst_pipeline_get_bus (GST_PIPELINE (pipe1));
+    gst_bus_set_sync_handler (bus, on_stream_status, NULL, NULL);
+    g_source_bus_watch = gst_bus_add_watch (bus, on_bus_message, NULL);
+    gst_object_unref (bus);
+  }
+  /* Our DTLS certificate, and the probes for the handshake timings */
+  g_signal_connect_data (pipe1, "deep-element-added",
+      G_CALLBACK (on_deep_element_added), g_strdup (get_dtls_pem ()),
+      (GClosureNotify) g_free, 0);
   webrtc1 = gst_element_factory_make("webrtcbin", NULL);
   g_assert_nonnull (webrtc1);
 
   //g_object_set(webrtc1, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_COMPAT, NULL);
   g_object_set(webrtc1, "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
-  g_object_set(webrtc1, "stun-server", STUN_SERVER, NULL, "name", "sendrecv", NULL);
+  g_object_set(webrtc1, "name", "sendrecv", NULL);
+  if (!host_only && stun_server && *stun_server)
+    g_object_set(webrtc1, "stun-server", stun_server, NULL);
+  if (!host_only && turn_server)
+    g_object_set(webrtc1, "turn-server", turn_server, NULL);
+
+  /* With max-bundle and rtcp-mux everything in the session shares one
+   * transport, so this is one UDP socket per interface. libnice has no way
+   * to share sockets between agents, so sessions can't share ports; a port
+   * range sized to the number of sessions is what keeps firewall rules
+   * small. */
+  {
+    GstWebRTCICE *ice;
+    GObject *agent = NULL;
+
+    g_object_get (webrtc1, "ice-agent", &ice, NULL);
+    /* The NiceAgent isn't public API, so be careful */
+    if (g_object_class_find_property (G_OBJECT_GET_CLASS (ice), "agent"))
+      g_object_get (ice, "agent", &agent, NULL);
+    if (agent) {
+      g_signal_connect (agent, "new-selected-pair",
+          G_CALLBACK (on_new_selected_pair), NULL);
+      if (ice_addresses)
+        restrict_ice_addresses (NICE_AGENT (agent));
+      g_object_unref (agent);
+    }
+
+    if (ice_min_port)
+      g_object_set (ice, "min-rtp-port", ice_min_port, NULL);
+    if (ice_max_port)
+      g_object_set (ice, "max-rtp-port", ice_max_port, NULL);
+    if (ice_udp_only)
+      g_object_set (ice, "ice-tcp", FALSE, NULL);
+    gst_object_unref (ice);
+  }
 
   gst_bin_add(GST_BIN(pipe1), webrtc1);
 
@@ -929,6 +3548,10 @@ start_pipeline ()
       G_CALLBACK (send_ice_candidate_message), NULL);
   g_signal_connect (webrtc1, "notify::ice-gathering-state",
       G_CALLBACK (on_ice_gathering_state_notify), NULL);
+  g_signal_connect (webrtc1, "notify::ice-connection-state",
+      G_CALLBACK (on_ice_connection_state_notify), NULL);
+  g_signal_connect (webrtc1, "notify::connection-state",
+      G_CALLBACK (on_connection_state_notify), NULL);
 
   gst_element_set_state (pipe1, GST_STATE_READY);
 
@@ -955,6 +3578,8 @@ start_pipeline ()
 
 
   //g_source_stats_timeout = g_timeout_add (100, (GSourceFunc) webrtcbin_get_stats, webrtc1);
+  g_source_session_stats_timeout = g_timeout_add_seconds (
+      SESSION_STATS_INTERVAL, (GSourceFunc) print_session_stats, NULL);
 
   gst_print ("Starting pipeline\n");
   ret = gst_element_set_state (GST_ELEMENT (pipe1), GST_STATE_PLAYING);
@@ -1006,11 +3631,11 @@ register_with_server (void)
     id = g_random_int_range (10, 10000);
     gst_print ("Registering id %i with server\n", id);
 
-    hello = g_strdup_printf ("HELLO %i", id);
+    hello = g_strdup_printf ("HELLO %i%s", id, compact ? " compact" : "");
   } else {
     gst_print ("Registering id %s with server\n", our_id);
 
-    hello = g_strdup_printf ("HELLO %s", our_id);
+    hello = g_strdup_printf ("HELLO %s%s", our_id, compact ? " compact" : "");
   }
 
   app_state = SERVER_REGISTERING;
@@ -1078,9 +3703,20 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
   gchar *text;
 
   switch (type) {
-    case SOUP_WEBSOCKET_DATA_BINARY:
-      gst_printerr ("Received unknown binary message, ignoring\n");
-      return;
+    case SOUP_WEBSOCKET_DATA_BINARY:{
+      gsize size;
+      const guint8 *data = g_bytes_get_data (message, &size);
+      /* Compact framing: a relayed message in an envelope, unwrap it and
+       * handle the payload like any other text message */
+      if (!compact_framing || size < 2 || data[0] != ENVELOPE_RELAY
+          || size < 2 + (gsize) data[1]) {
+        gst_printerr ("Received unknown binary message, ignoring\n");
+        return;
+      }
+      text = g_strndup ((const gchar *) data + 2 + data[1],
+          size - 2 - data[1]);
+      break;
+    }
     case SOUP_WEBSOCKET_DATA_TEXT:{
       gsize size;
       const gchar *data = g_bytes_get_data (message, &size);
@@ -1092,7 +3728,7 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
       g_assert_not_reached ();
   }
 
-  if (g_strcmp0 (text, "HELLO") == 0) {
+  if (g_strcmp0 (text, "HELLO") == 0 || g_strcmp0 (text, "HELLO compact") == 0) {
     /* Server has accepted our registration, we are ready to send commands */
     if (app_state != SERVER_REGISTERING) {
       cleanup_and_quit_loop ("ERROR: Received HELLO when not registering",
@@ -1100,7 +3736,10 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
       goto out;
     }
     app_state = SERVER_REGISTERED;
-    gst_print ("Registered with server\n");
+    /* Servers that don't know about compact framing just reply HELLO */
+    compact_framing = g_str_has_suffix (text, " compact");
+    gst_print ("Registered with server%s\n",
+        compact_framing ? ", using compact framing" : "");
     if (!our_id) {
       /* Ask signalling server to connect us with a specific peer */
       if (!setup_call ()) {
@@ -1235,6 +3874,7 @@ on_server_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
       sdpmlineindex = json_object_get_int_member (child, "sdpMLineIndex");
 
       /* Add ice candidate sent by remote peer */
+      remember_candidate_kind ("R:", candidate);
       g_signal_emit_by_name (webrtc1, "add-ice-candidate", sdpmlineindex,
           candidate);
     } else {
@@ -1272,6 +3912,260 @@ on_server_connected (SoupSession * session, GAsyncResult * res,
   register_with_server ();
 }
 
+/*
+ * Embedded signalling, with --listen-port. The browser connects straight to
+ * us, and we play both the signalling server (HELLO, SESSION) and the peer it
+ * would have connected the browser to. Everything after SESSION_OK is the
+ * same as with a signalling server, so it goes to on_server_message().
+ */
+static void
+on_browser_message (SoupWebsocketConnection * conn, SoupWebsocketDataType type,
+    GBytes * message, gpointer user_data)
+{
+  gsize size;
+  const gchar *data;
+  gchar *text, *reply = NULL;
+
+  if (type != SOUP_WEBSOCKET_DATA_TEXT) {
+    on_server_message (conn, type, message, user_data);
+    return;
+  }
+
+  data = g_bytes_get_data (message, &size);
+  text = g_strndup (data, size);
+
+  if (g_str_has_prefix (text, "HELLO ")) {
+    if (app_state != SERVER_CONNECTED) {
+      reply = g_strdup ("ERROR already registered");
+    } else {
+      gst_print ("Browser %s registered\n", text + strlen ("HELLO "));
+      app_state = SERVER_REGISTERED;
+      reply = g_strdup ("HELLO");
+    }
+  } else if (g_str_has_prefix (text, "SESSION ")) {
+    const gchar *callee = text + strlen ("SESSION ");
+
+    if (app_state != SERVER_REGISTERED) {
+      reply = g_strdup ("ERROR not registered, or already in a session");
+    } else if (g_strcmp0 (callee, our_id) != 0) {
+      reply = g_strdup_printf ("ERROR peer '%s' not found", callee);
+    } else {
+      app_state = PEER_CONNECTED;
+      reply = g_strdup ("SESSION_OK");
+    }
+  } else if (app_state < PEER_CONNECTED) {
+    reply = g_strdup_printf ("ERROR unknown command '%s'", text);
+  } else {
+    on_server_message (conn, type, message, user_data);
+  }
+
+  if (reply)
+    soup_websocket_connection_send_text (conn, reply);
+  g_free (reply);
+  g_free (text);
+}
+
+static void
+on_browser_connected (SoupServer * server, SoupWebsocketConnection * conn,
+    const char *path, SoupClientContext * client, gpointer user_data)
+{
+  if (ws_conn) {
+    /* We only do one session at a time, see main() */
+    gst_print ("Rejecting browser %s, already in a session\n",
+        soup_client_context_get_host (client));
+    g_object_ref (conn);
+    g_signal_connect (conn, "closed", G_CALLBACK (g_object_unref), NULL);
+    soup_websocket_connection_send_text (conn, "ERROR busy");
+    soup_websocket_connection_close (conn,
+        SOUP_WEBSOCKET_CLOSE_POLICY_VIOLATION, "busy");
+    return;
+  }
+
+  gst_print ("Browser %s connected\n", soup_client_context_get_host (client));
+  ws_conn = g_object_ref (conn);
+  compact_framing = FALSE;
+  app_state = SERVER_CONNECTED;
+
+  g_signal_connect (ws_conn, "closed", G_CALLBACK (on_server_closed), NULL);
+  g_signal_connect (ws_conn, "message", G_CALLBACK (on_browser_message), NULL);
+}
+
+/* Reply to the pending WHIP/WHEP request with our local description, which
+ * by now has all our candidates */
+static gboolean
+whip_send_answer (void)
+{
+  GstWebRTCSessionDescription *answer = NULL;
+  gchar *text;
+  guint i, j;
+
+  if (!whip_msg)
+    return G_SOURCE_REMOVE;
+
+  g_object_get (webrtc1, "local-description", &answer, NULL);
+  if (!answer) {
+    soup_message_set_status (whip_msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+  } else {
+    /* Same candidate filtering as send_ice_candidate_message() */
+    for (i = 0; i < gst_sdp_message_medias_len (answer->sdp); i++) {
+      GstSDPMedia *media =
+          (GstSDPMedia *) gst_sdp_message_get_media (answer->sdp, i);
+
+      for (j = gst_sdp_media_attributes_len (media); j > 0; j--) {
+        const GstSDPAttribute *attr = gst_sdp_media_get_attribute (media, j - 1);
+        gchar *candidate;
+
+        if (g_strcmp0 (attr->key, "candidate") != 0)
+          continue;
+        candidate = g_strdup_printf ("candidate:%s", attr->value);
+        if (!candidate_allowed (candidate))
+          gst_sdp_media_remove_attribute (media, j - 1);
+        g_free (candidate);
+      }
+    }
+
+    text = gst_sdp_message_as_text (answer->sdp);
+    gst_print ("Sending WHIP/WHEP answer:\n%s\n", text);
+    soup_message_set_status (whip_msg, SOUP_STATUS_CREATED);
+    soup_message_headers_replace (whip_msg->response_headers, "Location",
+        g_str_has_prefix (soup_message_get_uri (whip_msg)->path, "/whep") ?
+        "/whep/session" : "/whip/session");
+    soup_message_set_response (whip_msg, "application/sdp", SOUP_MEMORY_TAKE,
+        text, strlen (text));
+    gst_webrtc_session_description_free (answer);
+  }
+
+  soup_server_unpause_message (signalling_server, whip_msg);
+  g_clear_object (&whip_msg);
+  return G_SOURCE_REMOVE;
+}
+
+static void
+on_whip_finished (SoupMessage * msg, gpointer user_data)
+{
+  /* The client went away before we could answer */
+  if (msg == whip_msg) {
+    g_clear_object (&whip_msg);
+    cleanup_and_quit_loop ("WHIP/WHEP client went away", PEER_CALL_ERROR);
+  }
+}
+
+/*
+ * WHIP/WHEP style signalling: POST an SDP offer to /whip to send us media,
+ * or to /whep to receive our test pattern and audio, and get the answer in
+ * the reply. DELETE the returned Location to hang up.
+ */
+static void
+on_whip_request (SoupServer * server, SoupMessage * msg, const char *path,
+    GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+  gboolean whep = g_str_has_prefix (path, "/whep");
+  GstSDPMessage *sdp;
+  const gchar *content_type;
+
+  if (msg->method == SOUP_METHOD_DELETE) {
+    if (!g_str_has_suffix (path, "/session") || !pipe1 || ws_conn) {
+      soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+      return;
+    }
+    soup_message_set_status (msg, SOUP_STATUS_OK);
+    cleanup_and_quit_loop ("WHIP/WHEP session deleted", PEER_CALL_STOPPED);
+    return;
+  }
+
+  if (msg->method != SOUP_METHOD_POST || g_str_has_suffix (path, "/session")) {
+    /* No trickle ICE (PATCH) either, we want everything in the offer */
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  content_type = soup_message_headers_get_content_type (msg->request_headers,
+      NULL);
+  if (g_strcmp0 (content_type, "application/sdp") != 0) {
+    soup_message_set_status (msg, SOUP_STATUS_UNSUPPORTED_MEDIA_TYPE);
+    return;
+  }
+
+  /* One session at a time, like with websocket signalling */
+  if (ws_conn || pipe1 || whip_msg) {
+    soup_message_set_status (msg, SOUP_STATUS_CONFLICT);
+    return;
+  }
+
+  gst_sdp_message_new (&sdp);
+  if (gst_sdp_message_parse_buffer ((guint8 *) msg->request_body->data,
+          msg->request_body->length, sdp) != GST_SDP_OK
+      || gst_sdp_message_medias_len (sdp) == 0) {
+    gst_sdp_message_free (sdp);
+    soup_message_set_status (msg, SOUP_STATUS_BAD_REQUEST);
+    return;
+  }
+
+  gst_print ("Received %s offer from %s\n", whep ? "WHEP" : "WHIP",
+      soup_client_context_get_host (client));
+
+  if (!start_pipeline ()) {
+    gst_sdp_message_free (sdp);
+    soup_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  app_state = PEER_CALL_NEGOTIATING;
+
+  /* Our media has to be there before the offer, so that the answer sends it */
+  if (whep) {
+    send_video_to_browser (VIDEO_SOURCE_TEST_PATTERN);
+    send_audio_to_browser ();
+  }
+
+  whip_msg = g_object_ref (msg);
+  g_signal_connect (msg, "finished", G_CALLBACK (on_whip_finished), NULL);
+  soup_server_pause_message (server, msg);
+
+  /* Answered by whip_send_answer() once ICE gathering is complete */
+  on_offer_received (sdp);
+}
+
+static gboolean
+start_signalling_server (void)
+{
+  GTlsCertificate *cert = NULL;
+  GError *error = NULL;
+
+  if (listen_cert) {
+    cert = g_tls_certificate_new_from_files (listen_cert,
+        listen_key ? listen_key : listen_cert, &error);
+    if (!cert) {
+      gst_printerr ("Failed to load %s: %s\n", listen_cert, error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+  }
+
+  signalling_server = soup_server_new (SOUP_SERVER_SERVER_HEADER,
+      "webrtc-sendrecv", SOUP_SERVER_TLS_CERTIFICATE, cert, NULL);
+  g_clear_object (&cert);
+
+  soup_server_add_websocket_handler (signalling_server, NULL, NULL, NULL,
+      on_browser_connected, NULL, NULL);
+  soup_server_add_handler (signalling_server, "/whip", on_whip_request, NULL,
+      NULL);
+  soup_server_add_handler (signalling_server, "/whep", on_whip_request, NULL,
+      NULL);
+
+  if (!soup_server_listen_all (signalling_server, listen_port,
+          listen_cert ? SOUP_SERVER_LISTEN_HTTPS : 0, &error)) {
+    gst_printerr ("Failed to listen on port %d: %s\n", listen_port,
+        error->message);
+    g_error_free (error);
+    g_clear_object (&signalling_server);
+    return FALSE;
+  }
+
+  gst_print ("Waiting for browsers on %s://0.0.0.0:%d\n",
+      listen_cert ? "wss" : "ws", listen_port);
+  return TRUE;
+}
+
 /*
  * Connect to the signalling server. This is the entrypoint for everything else.
  */
@@ -1289,6 +4183,14 @@ connect_to_websocket_server_async (void)
       //SOUP_SESSION_SSL_CA_FILE, "/etc/ssl/certs/ca-bundle.crt",
       SOUP_SESSION_HTTPS_ALIASES, https_aliases, NULL);
 
+#if SOUP_CHECK_VERSION(2,68,0)
+  /* Offers permessage-deflate, which SDP compresses well with */
+  if (!soup_session_has_feature (session,
+          SOUP_TYPE_WEBSOCKET_EXTENSION_MANAGER))
+    soup_session_add_feature_by_type (session,
+        SOUP_TYPE_WEBSOCKET_EXTENSION_MANAGER);
+#endif
+
   logger = soup_logger_new (SOUP_LOGGER_LOG_BODY, -1);
   soup_session_add_feature (session, SOUP_SESSION_FEATURE (logger));
   g_object_unref (logger);
@@ -1303,6 +4205,116 @@ connect_to_websocket_server_async (void)
   app_state = SERVER_CONNECTING;
 }
 
+/* Sends a STUN Binding request (RFC 5389) to @address, retransmitted every
+ * STUN_CHECK_RETRANSMIT, and waits up to STUN_CHECK_TIMEOUT for the success
+ * response to it */
+static gboolean
+stun_binding_check (GSocketAddress * address, GError ** error)
+{
+  GSocket *socket;
+  guint8 request[20], response[548];
+  gboolean ok = FALSE;
+  guint i, attempt;
+
+  socket = g_socket_new (g_socket_address_get_family (address),
+      G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, error);
+  if (!socket)
+    return FALSE;
+  /* Connected, so we only hear from the server and an ICMP port unreachable
+   * fails right away */
+  if (!g_socket_connect (socket, address, NULL, error))
+    goto out;
+
+  /* No attributes, just the header with a random transaction id */
+  GST_WRITE_UINT16_BE (request, 0x0001);
+  GST_WRITE_UINT16_BE (request + 2, 0);
+  GST_WRITE_UINT32_BE (request + 4, STUN_MAGIC_COOKIE);
+  for (i = 8; i < sizeof (request); i += 4)
+    GST_WRITE_UINT32_BE (request + i, g_random_int ());
+
+  for (attempt = 0; !ok &&
+      attempt < STUN_CHECK_TIMEOUT / STUN_CHECK_RETRANSMIT; attempt++) {
+    gint64 deadline = g_get_monotonic_time () + STUN_CHECK_RETRANSMIT;
+    gint64 left;
+
+    if (g_socket_send (socket, (gchar *) request, sizeof (request), NULL,
+            error) < 0)
+      goto out;
+    while (!ok && (left = deadline - g_get_monotonic_time ()) > 0 &&
+        g_socket_condition_timed_wait (socket, G_IO_IN, left, NULL, NULL)) {
+      gssize len = g_socket_receive (socket, (gchar *) response,
+          sizeof (response), NULL, error);
+
+      if (len < 0)
+        goto out;
+      /* Binding success response, with our cookie and transaction id */
+      ok = len >= 20 && GST_READ_UINT16_BE (response) == 0x0101 &&
+          memcmp (response + 4, request + 4, 16) == 0;
+    }
+  }
+  if (!ok)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+        "no Binding response in %" G_GINT64_FORMAT " ms",
+        (gint64) STUN_CHECK_TIMEOUT / G_TIME_SPAN_MILLISECOND);
+
+out:
+  g_object_unref (socket);
+  return ok;
+}
+
+/* An unreachable STUN server stalls gathering until libnice gives up on it,
+ * which happens on isolated networks or behind firewalls that drop UDP.
+ * Check once that it answers a Binding request, and go without STUN if not. */
+static void
+check_stun_server (void)
+{
+  GResolver *resolver;
+  GError *error = NULL;
+  GList *addresses;
+  GSocketAddress *address;
+  GstUri *uri;
+  guint port;
+
+  if (host_only || !stun_server || !*stun_server)
+    return;
+
+  uri = gst_uri_from_string (stun_server);
+  if (!uri || !gst_uri_get_host (uri)) {
+    gst_printerr ("Invalid STUN server %s, not using STUN\n", stun_server);
+    stun_server = NULL;
+    goto out;
+  }
+  port = gst_uri_get_port (uri);
+  if (port == GST_URI_NO_PORT)
+    port = STUN_DEFAULT_PORT;
+
+  resolver = g_resolver_get_default ();
+  addresses = g_resolver_lookup_by_name (resolver, gst_uri_get_host (uri),
+      NULL, &error);
+  g_object_unref (resolver);
+  if (!addresses) {
+    gst_printerr ("Can't resolve STUN server %s (%s), not using STUN\n",
+        stun_server, error->message);
+    g_clear_error (&error);
+    stun_server = NULL;
+    goto out;
+  }
+
+  address = g_inet_socket_address_new (addresses->data, port);
+  g_resolver_free_addresses (addresses);
+  if (!stun_binding_check (address, &error)) {
+    gst_printerr ("STUN server %s doesn't answer (%s), not using STUN\n",
+        stun_server, error->message);
+    g_clear_error (&error);
+    stun_server = NULL;
+  }
+  g_object_unref (address);
+
+out:
+  if (uri)
+    gst_uri_unref (uri);
+}
+
 static gboolean
 check_plugins (void)
 {
@@ -1350,6 +4362,21 @@ main (int argc, char *argv[])
     goto out;
   }
 
+  if (listen_port && !start_signalling_server ())
+    goto out;
+
+  if (!check_thread_placement ())
+    goto out;
+
+  if ((pre_encoded_pattern || test_pattern_file) && !load_test_pattern ())
+    goto out;
+
+  if (media_file && !start_media_reader ())
+    goto out;
+
+  check_stun_server ();
+  prewarm_dtls ();
+
   ret_code = 0;
 
   /* Disable ssl when running a localhost server, because
@@ -1365,18 +4392,45 @@ main (int argc, char *argv[])
 
   for(;;) {
     loop = g_main_loop_new (NULL, FALSE);
-    connect_to_websocket_server_async ();
+    /* With embedded signalling, on_browser_connected() starts the session */
+    if (!signalling_server)
+      connect_to_websocket_server_async ();
     g_main_loop_run (loop);
 
+    /* The session failed before we could answer a WHIP/WHEP offer */
+    if (whip_msg) {
+      soup_message_set_status (whip_msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+      soup_server_unpause_message (signalling_server, whip_msg);
+      g_clear_object (&whip_msg);
+    }
+
     // Stop the ping "timeout"
-    g_source_remove(g_source_data_channel_ping_timeout);
+    if (g_source_data_channel_ping_timeout)
+      g_source_remove(g_source_data_channel_ping_timeout);
     // Reset this so a new timeout gets added for a new session
     g_source_data_channel_ping_timeout = 0;
     // Stop the stats "timeout"
-
+    if (g_source_session_stats_timeout)
+      g_source_remove (g_source_session_stats_timeout);
+    g_source_session_stats_timeout = 0;
+    g_clear_object (&data_channel);
+    if (g_source_bus_watch)
+      g_source_remove (g_source_bus_watch);
+    g_source_bus_watch = 0;
+
+    /* The browser may have left before asking for an offer */
+    if (!pipe1)
+      continue;
+    pace_unschedule ();
     gst_element_set_state (GST_ELEMENT (pipe1), GST_STATE_NULL);
     gst_print ("Pipeline stopped\n");
-    gst_object_unref (pipe1);
+    g_clear_object (&pipe1);
+    /* These belonged to pipe1, the next session must not find them. A
+     * latency update or a bus message from its pipeline can come before it
+     * sends anything. */
+    webrtc1 = video_bin = audio_bin = NULL;
+    video_sink = audio_sink = NULL;
+    incoming_video_pad_name = incoming_audio_pad_name = NULL;
   }
 
 
@@ -440,6 +440,11 @@ function websocketServerConnect() {
         throw new Error ("Don't know how to connect to the signalling server with uri" + window.location);
     }
     var ws_url = 'wss://' + ws_server + ':' + ws_port
+    // ?signalling=ws://host:port connects somewhere else, for instance straight
+    // to a webrtc-sendrecv started with --listen-port
+    var params = new URLSearchParams(window.location.search);
+    if (params.has("signalling"))
+        ws_url = params.get("signalling");
     setStatus("Connecting to server " + ws_url);
     ws_conn = new WebSocket(ws_url);
     /* When connected, immediately register with the server */
@@ -481,6 +486,16 @@ const handleDataChannelOpen = (event) =>{
 const handleDataChannelMessageReceived = (event) =>{
     //setStatus("Received data channel message");
     if (typeof event.data === 'string' || event.data instanceof String) {
+        // Periodic session accounting from the sender, not a ping
+        if (event.data.startsWith("STATS ")) {
+            console.log('Session stats: ', JSON.parse(event.data.substr(6)));
+            return;
+        }
+        // Errors, warnings and latency changes in the sender's pipeline
+        if (event.data.startsWith("EVENT ")) {
+            console.log('Pipeline event: ', JSON.parse(event.data.substr(6)));
+            return;
+        }
         console.log('Incoming string message: ' + event.data);
         textarea = document.getElementById("text")
         textarea.value =  event.data
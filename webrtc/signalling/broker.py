@@ -0,0 +1,476 @@
+#
+# Peer and room brokers, used to run the signalling server as several
+# processes (on one host or many) that share peers and rooms.
+#
+# A broker owns the global state that used to live in the dicts of a single
+# WebRTCSimpleServer: which server process a peer is connected to, and which
+# peers are in which room. Messages for a peer connected to another process
+# are routed through the broker to that process.
+#
+#  * LocalBroker: everything lives in this process, this is the default and is
+#    what the server always did.
+#  * HubBroker: talks to a BrokerHub over a unix socket ('uds:/path') or TCP
+#    ('tcp:host:port'). Run one hub, and any number of servers pointing at it.
+#
+# Any other backend (a Redis-compatible store, for instance) only needs to
+# implement the Broker methods below.
+#
+
+import json
+import struct
+import asyncio
+
+
+class Broker(object):
+    '''
+    Interface between a WebRTCSimpleServer and the shared peer/room state.
+    Callbacks into the server: deliver_local(), join_session(), end_session().
+    '''
+
+    async def start(self, server):
+        self.server = server
+
+    async def stop(self):
+        pass
+
+    # Claim @uid for the calling server, returns False if it's taken
+    async def register(self, uid):
+        raise NotImplementedError
+
+    async def unregister(self, uid):
+        raise NotImplementedError
+
+    # Whether @uid is connected to any server
+    async def lookup(self, uid):
+        raise NotImplementedError
+
+    # Returns the peers already in the room, or None if @uid already is too
+    async def room_join(self, room_id, uid):
+        raise NotImplementedError
+
+    # Returns whether @uid was in the room
+    async def room_leave(self, room_id, uid):
+        raise NotImplementedError
+
+    async def room_has(self, room_id, uid):
+        raise NotImplementedError
+
+    async def room_peers(self, room_id):
+        raise NotImplementedError
+
+    # Send @msg to @uid, which is connected to another server
+    async def deliver(self, uid, msg):
+        raise NotImplementedError
+
+    # Send @msg to every peer in the room except @uid
+    async def room_broadcast(self, room_id, uid, msg):
+        raise NotImplementedError
+
+    # Tell the server owning @uid that it is now in a session with @other_id
+    async def join_session(self, uid, other_id):
+        raise NotImplementedError
+
+    # Tell the server owning @uid that its session partner went away
+    async def end_session(self, uid):
+        raise NotImplementedError
+
+
+class LocalBroker(Broker):
+    '''
+    Single process broker, every peer is connected to our server
+    '''
+
+    def __init__(self):
+        self.peers = set()
+        # Format: {room_id: {peer1_id, peer2_id, peer3_id, ...}}
+        self.rooms = dict()
+
+    async def register(self, uid):
+        if uid in self.peers:
+            return False
+        self.peers.add(uid)
+        return True
+
+    async def unregister(self, uid):
+        self.peers.discard(uid)
+
+    async def lookup(self, uid):
+        return uid in self.peers
+
+    async def room_join(self, room_id, uid):
+        room_peers = self.rooms.setdefault(room_id, set())
+        if uid in room_peers:
+            return None
+        existing = list(room_peers)
+        room_peers.add(uid)
+        return existing
+
+    async def room_leave(self, room_id, uid):
+        room_peers = self.rooms.get(room_id, set())
+        if uid not in room_peers:
+            return False
+        room_peers.remove(uid)
+        return True
+
+    async def room_has(self, room_id, uid):
+        return uid in self.rooms.get(room_id, set())
+
+    async def room_peers(self, room_id):
+        return list(self.rooms.get(room_id, set()))
+
+    async def deliver(self, uid, msg):
+        self.server.deliver_local([uid], msg)
+
+    async def room_broadcast(self, room_id, uid, msg):
+        self.server.deliver_local([pid for pid in self.rooms[room_id] if pid != uid], msg)
+
+    async def join_session(self, uid, other_id):
+        self.server.join_session(uid, other_id)
+
+    async def end_session(self, uid):
+        await self.server.end_session(uid)
+
+
+############### Hub wire format ###############
+
+# Frame: total length, header length, JSON header, payload. The payload is a
+# relayed peer message and is kept out of the JSON so it is never re-encoded.
+FRAME = struct.Struct('!IH')
+
+
+def encode_frame(header, payload=None):
+    if payload is None:
+        payload = b''
+    elif isinstance(payload, str):
+        header['payload'] = 'text'
+        payload = payload.encode()
+    else:
+        header['payload'] = 'binary'
+    header = json.dumps(header).encode()
+    return FRAME.pack(len(header) + len(payload), len(header)) + header + payload
+
+
+async def read_frame(reader):
+    total, hlen = FRAME.unpack(await reader.readexactly(FRAME.size))
+    data = await reader.readexactly(total)
+    header = json.loads(data[:hlen])
+    payload = data[hlen:]
+    if header.get('payload') == 'text':
+        payload = payload.decode()
+    elif 'payload' not in header:
+        payload = None
+    return header, payload
+
+
+async def open_connection(address):
+    kind, _, where = address.partition(':')
+    if kind == 'uds':
+        return await asyncio.open_unix_connection(where)
+    if kind == 'tcp':
+        host, port = where.rsplit(':', 1)
+        return await asyncio.open_connection(host, int(port))
+    raise ValueError('Unknown broker address {!r}'.format(address))
+
+
+async def start_server(handler, address):
+    kind, _, where = address.partition(':')
+    if kind == 'uds':
+        return await asyncio.start_unix_server(handler, where)
+    if kind == 'tcp':
+        host, port = where.rsplit(':', 1)
+        return await asyncio.start_server(handler, host, int(port))
+    raise ValueError('Unknown broker address {!r}'.format(address))
+
+
+class HubBroker(Broker):
+    '''
+    Broker client, shares state with other servers through a BrokerHub
+    '''
+
+    def __init__(self, address):
+        self.address = address
+        self.reader = None
+        self.writer = None
+        self.read_task = None
+        # Format: {request_id: (asyncio.Future, callback or None)}
+        self.pending = dict()
+        self.next_id = 0
+        # Our own peers in each room, so that room broadcasts reach them
+        # without a round trip through the hub.
+        # Format: {room_id: {peer1_id, peer2_id, ...}}
+        self.local_rooms = dict()
+        # All the peers, ours or not, of the rooms that have one of ours,
+        # kept up to date by the hub so that relaying a ROOM_PEER_MSG needs
+        # no round trip to it.
+        # Format: {room_id: {peer1_id, peer2_id, ...}}
+        self.room_members = dict()
+
+    async def start(self, server):
+        await super().start(server)
+        # The hub may still be starting up, give it a few seconds
+        for _ in range(50):
+            try:
+                self.reader, self.writer = await open_connection(self.address)
+                break
+            except (ConnectionRefusedError, FileNotFoundError):
+                await asyncio.sleep(0.1)
+        else:
+            raise ConnectionError('Broker hub at {!r} not reachable'.format(self.address))
+        print('Connected to broker hub at {!r}'.format(self.address))
+        self.read_task = asyncio.create_task(self.read_loop())
+
+    async def stop(self):
+        if self.read_task:
+            self.read_task.cancel()
+        if self.writer:
+            self.writer.close()
+
+    async def read_loop(self):
+        try:
+            while True:
+                header, payload = await read_frame(self.reader)
+                op = header['op']
+                if op == 'reply':
+                    fut, callback = self.pending.pop(header['id'], (None, None))
+                    # Run here rather than in the awaiting task, so that the
+                    # room updates read after this reply apply on top of it
+                    if callback:
+                        callback(header['result'])
+                    if fut and not fut.done():
+                        fut.set_result(header['result'])
+                elif op == 'room_update':
+                    members = self.room_members.get(header['room_id'])
+                    if members is not None:
+                        if header['joined']:
+                            members.add(header['uid'])
+                        else:
+                            members.discard(header['uid'])
+                elif op == 'deliver':
+                    self.server.deliver_local(header['uids'], payload)
+                elif op == 'join_session':
+                    self.server.join_session(header['uid'], header['other_id'])
+                elif op == 'end_session':
+                    await self.server.end_session(header['uid'])
+        except (asyncio.IncompleteReadError, ConnectionError):
+            print('Lost connection to broker hub, stopping server')
+            for fut, _ in self.pending.values():
+                fut.cancel()
+            self.server.stop()
+
+    async def request(self, op, callback=None, **args):
+        self.next_id += 1
+        fut = asyncio.get_running_loop().create_future()
+        self.pending[self.next_id] = (fut, callback)
+        self.writer.write(encode_frame(dict(op=op, id=self.next_id, **args)))
+        await self.writer.drain()
+        return await fut
+
+    async def post(self, op, payload=None, **args):
+        self.writer.write(encode_frame(dict(op=op, **args), payload))
+        await self.writer.drain()
+
+    async def register(self, uid):
+        return await self.request('register', uid=uid)
+
+    async def unregister(self, uid):
+        await self.post('unregister', uid=uid)
+
+    async def lookup(self, uid):
+        return await self.request('lookup', uid=uid)
+
+    async def room_join(self, room_id, uid):
+        # Added before asking the hub, so no broadcast sent by our other peers
+        # in the meantime misses it
+        local_peers = self.local_rooms.setdefault(room_id, set())
+        joined = uid not in local_peers
+        local_peers.add(uid)
+
+        def joined_room(existing):
+            if existing is not None:
+                members = self.room_members.setdefault(room_id, set())
+                members.update(existing)
+                members.add(uid)
+        existing = await self.request('room_join', callback=joined_room,
+                                      room_id=room_id, uid=uid)
+        if existing is None and joined:
+            self.drop_local(room_id, uid)
+        return existing
+
+    async def room_leave(self, room_id, uid):
+        self.drop_local(room_id, uid)
+        self.room_members.get(room_id, set()).discard(uid)
+        return await self.request('room_leave', room_id=room_id, uid=uid)
+
+    def drop_local(self, room_id, uid):
+        local_peers = self.local_rooms.get(room_id, set())
+        local_peers.discard(uid)
+        if not local_peers:
+            self.local_rooms.pop(room_id, None)
+            # The hub stops telling us about it once we have no peer there
+            self.room_members.pop(room_id, None)
+
+    async def room_has(self, room_id, uid):
+        members = self.room_members.get(room_id)
+        if members is not None:
+            return uid in members
+        return await self.request('room_has', room_id=room_id, uid=uid)
+
+    async def room_peers(self, room_id):
+        members = self.room_members.get(room_id)
+        if members is not None:
+            return list(members)
+        return await self.request('room_peers', room_id=room_id)
+
+    async def deliver(self, uid, msg):
+        await self.post('deliver', msg, uid=uid)
+
+    async def room_broadcast(self, room_id, uid, msg):
+        # The hub only sends it to the room peers of other servers
+        self.server.deliver_local([pid for pid in self.local_rooms.get(room_id, set())
+                                   if pid != uid], msg)
+        await self.post('room_broadcast', msg, room_id=room_id, uid=uid)
+
+    async def join_session(self, uid, other_id):
+        await self.post('join_session', uid=uid, other_id=other_id)
+
+    async def end_session(self, uid):
+        await self.post('end_session', uid=uid)
+
+
+class BrokerHub(object):
+    '''
+    Owns the peer and room state for all connected servers ('shards'), and
+    routes messages to the shard that owns the destination peer.
+    '''
+
+    def __init__(self, address):
+        self.address = address
+        # Format: {uid: shard StreamWriter}
+        self.owners = dict()
+        # Format: {shard StreamWriter: {uid, ...}}
+        self.shards = dict()
+        # Format: {room_id: {peer1_id, peer2_id, peer3_id, ...}}
+        self.rooms = dict()
+        # Format: {uid: room_id}
+        self.peer_rooms = dict()
+
+    async def serve(self):
+        server = await start_server(self.shard_handler, self.address)
+        print('Broker hub listening on {!r}'.format(self.address))
+        async with server:
+            await server.serve_forever()
+
+    async def shard_handler(self, reader, writer):
+        self.shards[writer] = set()
+        print('Shard connected, {} in total'.format(len(self.shards)))
+        try:
+            while True:
+                header, payload = await read_frame(reader)
+                result = self.dispatch(writer, header, payload)
+                if 'id' in header:
+                    writer.write(encode_frame({'op': 'reply', 'id': header['id'],
+                                               'result': result}))
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            self.drop_shard(writer)
+
+    def route(self, uids, op, payload=None, **args):
+        by_shard = dict()
+        for uid in uids:
+            shard = self.owners.get(uid)
+            if shard:
+                by_shard.setdefault(shard, []).append(uid)
+        for shard, shard_uids in by_shard.items():
+            shard.write(encode_frame(dict(op=op, uids=shard_uids, **args), payload))
+
+    def leave_room(self, room_id, uid, shard=None):
+        room_peers = self.rooms.get(room_id)
+        if not room_peers or uid not in room_peers:
+            return False
+        room_peers.remove(uid)
+        del self.peer_rooms[uid]
+        if not room_peers:
+            del self.rooms[room_id]
+        self.update_room(room_id, uid, False, shard)
+        return True
+
+    def update_room(self, room_id, uid, joined, origin):
+        '''
+        Tell the shards with peers in the room, apart from the one the change
+        came from, that uid joined or left it
+        '''
+        shards = {self.owners.get(pid) for pid in self.rooms.get(room_id, set())}
+        shards.discard(None)
+        shards.discard(origin)
+        frame = encode_frame({'op': 'room_update', 'room_id': room_id,
+                              'uid': uid, 'joined': joined})
+        for shard in shards:
+            shard.write(frame)
+
+    def dispatch(self, shard, header, payload):
+        op = header['op']
+        uid = header.get('uid')
+        if op == 'register':
+            if uid in self.owners:
+                return False
+            self.owners[uid] = shard
+            self.shards[shard].add(uid)
+            return True
+        if op == 'unregister':
+            if self.owners.get(uid) is shard:
+                del self.owners[uid]
+                self.shards[shard].discard(uid)
+            return None
+        if op == 'lookup':
+            return uid in self.owners
+        room_id = header.get('room_id')
+        if op == 'room_join':
+            room_peers = self.rooms.setdefault(room_id, set())
+            if uid in room_peers:
+                return None
+            existing = list(room_peers)
+            room_peers.add(uid)
+            self.peer_rooms[uid] = room_id
+            self.update_room(room_id, uid, True, shard)
+            return existing
+        if op == 'room_leave':
+            return self.leave_room(room_id, uid, shard)
+        if op == 'room_has':
+            return uid in self.rooms.get(room_id, set())
+        if op == 'room_peers':
+            return list(self.rooms.get(room_id, set()))
+        if op == 'deliver':
+            self.route([uid], 'deliver', payload)
+        elif op == 'room_broadcast':
+            # The sending shard already delivered to its own peers
+            self.route([pid for pid in self.rooms.get(room_id, set())
+                        if self.owners.get(pid) is not shard], 'deliver', payload)
+        elif op == 'join_session':
+            self.route_one(uid, op, other_id=header['other_id'])
+        elif op == 'end_session':
+            self.route_one(uid, op)
+        else:
+            print('Ignoring unknown broker op {!r}'.format(op))
+        return None
+
+    def route_one(self, uid, op, **args):
+        shard = self.owners.get(uid)
+        if shard:
+            shard.write(encode_frame(dict(op=op, uid=uid, **args)))
+
+    def drop_shard(self, shard):
+        uids = self.shards.pop(shard, set())
+        print('Shard disconnected, dropping its {} peers'.format(len(uids)))
+        for uid in uids:
+            del self.owners[uid]
+            room_id = self.peer_rooms.get(uid)
+            if room_id and self.leave_room(room_id, uid, shard):
+                self.route(self.rooms.get(room_id, set()), 'deliver',
+                           'ROOM_PEER_LEFT {}'.format(uid))
+
+
+def make_broker(address):
+    if address == 'local':
+        return LocalBroker()
+    return HubBroker(address)
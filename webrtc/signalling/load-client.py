@@ -0,0 +1,392 @@
+#!/usr/bin/env python3
+#
+# Load generator for the signalling server: runs thousands of synthetic peers
+# that register, set up sessions or join rooms, and relay SDP-sized offers and
+# answers followed by bursts of ICE candidates, like real peers do.
+#
+# Reports connection rate, registration and relay latency percentiles, and
+# errors, which is what we use to size signalling capacity.
+#
+
+import sys
+import ssl
+import json
+import time
+import uuid
+import random
+import asyncio
+import resource
+import argparse
+import websockets
+
+parser = argparse.ArgumentParser(formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('--url', default='wss://localhost:8443', help='URL to connect to')
+parser.add_argument('--peers', default=1000, type=int, help='Number of synthetic peers')
+parser.add_argument('--mode', default='session', choices=['session', 'room'],
+                    help='Pair peers up in 1-1 sessions, or put them in rooms')
+parser.add_argument('--room-size', default=10, type=int, help='Peers per room in room mode')
+parser.add_argument('--call', default=None,
+                    help='In session mode, have every peer call this uid (e.g. gst-peer) and send OFFER_REQUEST '
+                         'instead of pairing synthetic peers with each other')
+parser.add_argument('--connect-rate', default=200, type=float, help='New connections per second')
+parser.add_argument('--rounds', default=1, type=int, help='Offer/answer exchanges per session or room peer pair')
+parser.add_argument('--sdp-size', default=4000, type=int, help='Size of the SDP in offers and answers, in bytes')
+parser.add_argument('--ice-burst', default=8, type=int, help='ICE candidates sent after each offer or answer')
+parser.add_argument('--hold', default=5, type=float, help='Seconds to stay connected after the exchanges')
+parser.add_argument('--timeout', default=30, type=float, help='Seconds to wait for an expected message')
+parser.add_argument('--compact', default=False, action='store_true',
+                    help='Negotiate compact framing, and send relayed messages as binary envelopes')
+parser.add_argument('--no-deflate', default=False, action='store_true',
+                    help='Do not ask for permessage-deflate compression')
+parser.add_argument('--json', default=False, action='store_true', help='Print the report as JSON')
+
+options = parser.parse_args(sys.argv[1:])
+
+SERVER_ADDR = options.url
+RUN_ID = str(uuid.uuid4())[:6]
+
+sslctx = None
+if SERVER_ADDR.startswith(('wss://', 'https://')):
+    sslctx = ssl.create_default_context()
+    # FIXME
+    sslctx.check_hostname = False
+    sslctx.verify_mode = ssl.CERT_NONE
+
+
+class Stats(object):
+
+    def __init__(self):
+        self.started = time.monotonic()
+        self.connects = 0
+        self.connect_latency = []
+        self.relay_latency = []
+        self.msgs_sent = 0
+        self.msgs_received = 0
+        self.bytes_sent = 0
+        self.bytes_received = 0
+        # What actually went over the sockets, after compression and framing
+        self.wire_bytes_sent = 0
+        self.wire_bytes_received = 0
+        # Format: {error description: count}
+        self.errors = dict()
+        self.first_connect = None
+        self.last_connect = None
+
+    def error(self, what):
+        self.errors[what] = self.errors.get(what, 0) + 1
+
+    def report(self):
+        def pct(values, p):
+            if not values:
+                return None
+            values = sorted(values)
+            return round(values[min(len(values) - 1, int(len(values) * p / 100))] * 1000, 2)
+
+        def dist(values):
+            return {'count': len(values), 'p50': pct(values, 50), 'p90': pct(values, 90),
+                    'p99': pct(values, 99), 'max': pct(values, 100)}
+
+        ramp = (self.last_connect or 0) - (self.first_connect or 0)
+        elapsed = time.monotonic() - self.started
+        usage = resource.getrusage(resource.RUSAGE_SELF)
+        return {
+            'peers': options.peers,
+            'connected': self.connects,
+            'connect_rate': round(self.connects / ramp, 1) if ramp > 0 else None,
+            'connect_ms': dist(self.connect_latency),
+            'relay_ms': dist(self.relay_latency),
+            'msgs_sent': self.msgs_sent,
+            'msgs_received': self.msgs_received,
+            'relayed_msgs_per_sec': round(self.msgs_received / elapsed, 1),
+            'bytes_sent': self.bytes_sent,
+            'bytes_received': self.bytes_received,
+            'wire_bytes_sent': self.wire_bytes_sent,
+            'wire_bytes_received': self.wire_bytes_received,
+            'cpu_s': round(usage.ru_utime + usage.ru_stime, 2),
+            'errors': self.errors,
+            'elapsed_s': round(elapsed, 2),
+        }
+
+
+stats = Stats()
+
+
+def make_sdp(kind):
+    # Real SDP is mostly a=... lines, so pad with those rather than random junk
+    lines = ['v=0', 'o=- {} 2 IN IP4 127.0.0.1'.format(random.getrandbits(62)), 's=-', 't=0 0']
+    size = sum(len(line) + 2 for line in lines)
+    while size < options.sdp_size:
+        line = 'a=ssrc:{} cname:{}'.format(random.getrandbits(31), uuid.uuid4())
+        lines.append(line)
+        size += len(line) + 2
+    return {'type': kind, 'sdp': '\r\n'.join(lines) + '\r\n'}
+
+
+def make_ice(index):
+    candidate = 'candidate:{} 1 udp {} 10.{}.{}.{} {} typ host'.format(
+        random.getrandbits(31), random.getrandbits(31), random.randrange(256),
+        random.randrange(256), random.randrange(256), random.randrange(1024, 65536))
+    return {'candidate': candidate, 'sdpMLineIndex': index % 2}
+
+
+# Compact framing envelopes, see Protocol.md
+ENVELOPE_RELAY = 1
+ENVELOPE_ROOM_PEER_MSG = 2
+
+
+def pack_envelope(kind, peer_id, payload):
+    peer_id = peer_id.encode()
+    return bytes((kind, len(peer_id))) + peer_id + payload.encode()
+
+
+def envelope_to_text(frame):
+    kind, idlen = frame[0], frame[1]
+    payload = frame[2 + idlen:].decode()
+    if kind == ENVELOPE_ROOM_PEER_MSG:
+        return 'ROOM_PEER_MSG {} {}'.format(frame[2:2 + idlen].decode(), payload)
+    return payload
+
+
+def count_wire_bytes(ws):
+    data_received = ws.data_received
+    write = ws.transport.write
+
+    def counting_data_received(data):
+        stats.wire_bytes_received += len(data)
+        data_received(data)
+
+    def counting_write(data):
+        stats.wire_bytes_sent += len(data)
+        write(data)
+
+    ws.data_received = counting_data_received
+    ws.transport.write = counting_write
+
+
+class ServerError(Exception):
+    pass
+
+
+class SyntheticPeer(object):
+
+    def __init__(self, uid):
+        self.uid = uid
+        self.ws = None
+
+    async def send(self, msg):
+        await self.ws.send(msg)
+        stats.msgs_sent += 1
+        stats.bytes_sent += len(msg)
+
+    async def send_json(self, to, obj):
+        '''
+        Relay @obj to our session partner, or to peer @to in our room
+        '''
+        # Stamp every relayed message so the receiver can measure relay latency
+        obj['t'] = time.monotonic()
+        if options.compact:
+            kind = ENVELOPE_ROOM_PEER_MSG if to else ENVELOPE_RELAY
+            await self.send(pack_envelope(kind, to or '', json.dumps(obj)))
+        elif to:
+            await self.send('ROOM_PEER_MSG {} {}'.format(to, json.dumps(obj)))
+        else:
+            await self.send(json.dumps(obj))
+
+    async def send_sdp_ice(self, to, kind):
+        await self.send_json(to, {'sdp': make_sdp(kind)})
+        for i in range(options.ice_burst):
+            await self.send_json(to, {'ice': make_ice(i)})
+
+    async def connect(self):
+        start = time.monotonic()
+        self.ws = await websockets.connect(SERVER_ADDR, ssl=sslctx, max_queue=None,
+                                           compression=None if options.no_deflate else 'deflate')
+        count_wire_bytes(self.ws)
+        if options.compact:
+            await self.send('HELLO {} compact'.format(self.uid))
+            await self.expect(lambda m: m == 'HELLO compact')
+        else:
+            await self.send('HELLO ' + self.uid)
+            await self.expect(lambda m: m == 'HELLO')
+        now = time.monotonic()
+        stats.connect_latency.append(now - start)
+        stats.connects += 1
+        stats.first_connect = stats.first_connect or now
+        stats.last_connect = now
+
+    async def recv(self, timeout):
+        msg = await asyncio.wait_for(self.ws.recv(), timeout)
+        stats.msgs_received += 1
+        stats.bytes_received += len(msg)
+        if isinstance(msg, bytes):
+            msg = envelope_to_text(msg)
+        if msg.startswith('ERROR'):
+            stats.error(msg.split("'")[0].strip())
+            return msg
+        payload = msg
+        if msg.startswith('ROOM_PEER_MSG'):
+            _, _, payload = msg.split(maxsplit=2)
+        if payload.startswith('{'):
+            obj = json.loads(payload)
+            if 't' in obj:
+                stats.relay_latency.append(time.monotonic() - obj['t'])
+        return msg
+
+    async def expect(self, pred):
+        while True:
+            msg = await self.recv(options.timeout)
+            if msg.startswith('ERROR'):
+                raise ServerError(msg)
+            if pred(msg):
+                return msg
+
+    async def expect_sdp_ice(self, kind):
+        await self.expect(lambda m: '"sdp"' in m and '"{}"'.format(kind) in m)
+        for _ in range(options.ice_burst):
+            await self.expect(lambda m: '"ice"' in m)
+
+    async def run_room(self, room, joined):
+        await self.send('ROOM ' + room)
+        ok = await self.expect(lambda m: m.startswith('ROOM_OK'))
+        joined.set()
+        # By convention, newly-joined peers send the offers
+        _, *room_peers = ok.split()
+        for _ in range(options.rounds):
+            for pid in room_peers:
+                await self.send_sdp_ice(pid, 'offer')
+        # Collect our answers while answering offers from peers that join after
+        # us, until everything is in and we have held on for long enough
+        # Format: {peer_id: answer and ICE messages still expected from it}
+        pending = {pid: options.rounds * (1 + options.ice_burst) for pid in room_peers}
+        deadline = None
+        while True:
+            if deadline is None:
+                timeout = options.timeout
+            else:
+                timeout = deadline - time.monotonic()
+                if timeout <= 0:
+                    return
+            try:
+                msg = await self.recv(timeout)
+            except asyncio.TimeoutError:
+                if deadline is None:
+                    raise
+                return
+            if msg.startswith(('ERROR', 'ROOM_PEER_LEFT')):
+                # A peer we offered to went away, don't wait for its answer
+                pid = msg.split("'")[1] if msg.startswith('ERROR') else msg.split()[1]
+                pending.pop(pid, None)
+            elif msg.startswith('ROOM_PEER_MSG'):
+                _, sender, payload = msg.split(maxsplit=2)
+                if sender in pending:
+                    pending[sender] -= 1
+                    if pending[sender] == 0:
+                        del pending[sender]
+                elif '"offer"' in payload:
+                    await self.send_sdp_ice(sender, 'answer')
+            if not pending and deadline is None:
+                deadline = time.monotonic() + options.hold
+
+    async def close(self):
+        if self.ws:
+            await self.ws.close()
+
+
+ERRORS = (asyncio.TimeoutError, websockets.WebSocketException, OSError)
+
+
+async def run_session_pair(index):
+    caller = SyntheticPeer('load-{}-{}-a'.format(RUN_ID, index))
+    callee = SyntheticPeer('load-{}-{}-b'.format(RUN_ID, index))
+    try:
+        await callee.connect()
+        await caller.connect()
+        await caller.send('SESSION ' + callee.uid)
+        await caller.expect(lambda m: m == 'SESSION_OK')
+        for _ in range(options.rounds):
+            await caller.send_sdp_ice(None, 'offer')
+            await callee.expect_sdp_ice('offer')
+            await callee.send_sdp_ice(None, 'answer')
+            await caller.expect_sdp_ice('answer')
+        await asyncio.sleep(options.hold)
+    except ServerError:
+        pass
+    except ERRORS as e:
+        stats.error(type(e).__name__)
+    finally:
+        await caller.close()
+        await callee.close()
+
+
+async def run_caller(index):
+    caller = SyntheticPeer('load-{}-{}'.format(RUN_ID, index))
+    try:
+        await caller.connect()
+        await caller.send('SESSION ' + options.call)
+        await caller.expect(lambda m: m == 'SESSION_OK')
+        await caller.send('OFFER_REQUEST')
+        await caller.expect(lambda m: '"sdp"' in m)
+        await asyncio.sleep(options.hold)
+    except ServerError:
+        pass
+    except ERRORS as e:
+        stats.error(type(e).__name__)
+    finally:
+        await caller.close()
+
+
+async def run_room_peer(index, joined):
+    room = 'load-{}-{}'.format(RUN_ID, index // options.room_size)
+    peer = SyntheticPeer('load-{}-{}'.format(RUN_ID, index))
+    try:
+        await peer.connect()
+        await peer.run_room(room, joined)
+    except ServerError:
+        pass
+    except ERRORS as e:
+        stats.error(type(e).__name__)
+    finally:
+        joined.set()
+        await peer.close()
+
+
+async def main():
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < hard:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    tasks = []
+    interval = 1.0 / options.connect_rate
+    if options.mode == 'session' and options.call:
+        for i in range(options.peers):
+            tasks.append(asyncio.create_task(run_caller(i)))
+            await asyncio.sleep(interval)
+    elif options.mode == 'session':
+        for i in range(options.peers // 2):
+            tasks.append(asyncio.create_task(run_session_pair(i)))
+            await asyncio.sleep(2 * interval)
+    else:
+        for i in range(options.peers):
+            joined = asyncio.Event()
+            tasks.append(asyncio.create_task(run_room_peer(i, joined)))
+            # Join one at a time within a room, so each newcomer sees everyone
+            # before it and sends them offers
+            await joined.wait()
+            await asyncio.sleep(interval)
+    await asyncio.gather(*tasks)
+
+    report = stats.report()
+    if options.json:
+        print(json.dumps(report, indent=2))
+        return
+    for key, value in report.items():
+        print('{:>22}: {}'.format(key, value))
+
+try:
+    asyncio.run(main())
+except websockets.exceptions.InvalidHandshake:
+    print('Invalid handshake: are you sure this is a websockets server?\n')
+    raise
+except ssl.SSLError:
+    print('SSL Error: are you sure the server is using TLS?\n')
+    raise
@@ -15,7 +15,107 @@ import asyncio
 import websockets
 import argparse
 import http
-import concurrent
+import tempfile
+import multiprocessing
+
+from broker import make_broker, BrokerHub
+
+# Compact framing, see Protocol.md. Relayed messages are sent as binary frames
+# with a small routing header, so they can be routed without parsing text.
+ENVELOPE_RELAY = 1
+ENVELOPE_ROOM_PEER_MSG = 2
+
+
+def pack_envelope(kind, peer_id, payload):
+    peer_id = peer_id.encode()
+    return bytes((kind, len(peer_id))) + peer_id + payload
+
+
+def unpack_envelope(frame):
+    '''
+    Returns (kind, peer_id, payload), raises ValueError if @frame is malformed
+    '''
+    if len(frame) < 2 or len(frame) < 2 + frame[1]:
+        raise ValueError('short frame')
+    kind, idlen = frame[0], frame[1]
+    return kind, frame[2:2 + idlen].decode(), frame[2 + idlen:]
+
+
+def envelope_to_text(frame):
+    kind, peer_id, payload = unpack_envelope(frame)
+    if kind == ENVELOPE_ROOM_PEER_MSG:
+        return 'ROOM_PEER_MSG {} {}'.format(peer_id, payload.decode())
+    return payload.decode()
+
+
+class Heartbeat(object):
+    '''
+    Pings idle connections so bad routers don't close them, and reaps the ones
+    that stop answering. Peers are spread over a fixed number of buckets and
+    one bucket is swept at a time, so each peer is looked at once per @timeout
+    and receiving a message only costs noting the time.
+    '''
+
+    def __init__(self, timeout, spawn, nbuckets=16):
+        self.timeout = timeout
+        self.spawn = spawn
+        # Format: [{uid: Peer WebSocketServerProtocol}, ...]
+        self.buckets = [dict() for _ in range(nbuckets)]
+        # Format: {uid: bucket index}
+        self.slots = dict()
+        # Format: {uid: event loop time of the last message}
+        self.last_seen = dict()
+        # Format: {uid: pong waiter of the last keepalive ping}
+        self.pings = dict()
+        self.next_slot = 0
+        self.time = asyncio.get_event_loop().time
+
+    def add(self, uid, ws):
+        self.slots[uid] = slot = self.next_slot
+        self.next_slot = (slot + 1) % len(self.buckets)
+        self.buckets[slot][uid] = ws
+        self.last_seen[uid] = self.time()
+
+    def remove(self, uid, ws):
+        slot = self.slots.get(uid)
+        if slot is None or self.buckets[slot][uid] is not ws:
+            return
+        del self.slots[uid]
+        del self.buckets[slot][uid]
+        del self.last_seen[uid]
+        self.pings.pop(uid, None)
+
+    def touch(self, uid):
+        self.last_seen[uid] = self.time()
+
+    async def ping(self, uid, ws):
+        try:
+            pong = await ws.ping()
+        except websockets.ConnectionClosed:
+            return
+        # The peer may have gone, or come back on another connection, while
+        # the ping was being sent
+        slot = self.slots.get(uid)
+        if slot is not None and self.buckets[slot][uid] is ws:
+            self.pings[uid] = pong
+
+    def sweep(self, bucket):
+        now = self.time()
+        for uid, ws in bucket.items():
+            pong = self.pings.pop(uid, None)
+            if pong is not None and not pong.done():
+                print('No keepalive pong from {!r} in {}s, closing'.format(uid, self.timeout))
+                self.spawn(ws.close(code=1011, reason='keepalive ping timeout'))
+            elif now - self.last_seen[uid] >= self.timeout:
+                print('Sending keepalive ping to {!r} at {!r}'.format(uid, ws.remote_address))
+                self.spawn(self.ping(uid, ws))
+
+    async def run(self):
+        slot = 0
+        while True:
+            await asyncio.sleep(self.timeout / len(self.buckets))
+            self.sweep(self.buckets[slot])
+            slot = (slot + 1) % len(self.buckets)
 
 
 class WebRTCSimpleServer(object):
@@ -26,26 +126,43 @@ class WebRTCSimpleServer(object):
         # Format: {uid: (Peer WebSocketServerProtocol,
         #                remote_address,
         #                <'session'|room_id|None>)}
+        # Peers connected to this server
         self.peers = dict()
         # Format: {caller_uid: callee_uid,
         #          callee_uid: caller_uid}
-        # Bidirectional mapping between the two peers
+        # Mapping from each of our peers in a session to the other peer, which
+        # may be connected to another server
         self.sessions = dict()
-        # Format: {room_id: {peer1_id, peer2_id, peer3_id, ...}}
-        # Room dict with a set of peers in each room
-        self.rooms = dict()
+        # Format: {uid: (Peer WebSocketServerProtocol,
+        #                asyncio.Queue,
+        #                writer asyncio.Task)}
+        # Outbound messages for each peer, drained by a per-peer writer task.
+        # Binary envelopes are converted to text for peers that did not
+        # negotiate compact framing.
+        self.outboxes = dict()
+        # Background tasks we must keep a reference to until they are done
+        self.tasks = set()
 
         # Options
         self.addr = options.addr
         self.port = options.port
         self.keepalive_timeout = options.keepalive_timeout
-        self.cert_restart = options.cert_restart
+        self.cert_reload = options.cert_reload
         self.cert_path = options.cert_path
         self.disable_ssl = options.disable_ssl
         self.health_path = options.health
+        self.max_send_queue = options.max_send_queue
+        self.disable_deflate = options.disable_deflate
+        self.reuse_port = options.workers > 1
+
+        # Peer ownership and room membership, shared between servers if we
+        # are one of several
+        self.broker = make_broker(options.broker)
 
-        # Certificate mtime, used to detect when to restart the server
+        # Certificate mtime, used to detect when to reload the certificate
         self.cert_mtime = -1
+        # SSL context shared by all connections, reloaded in place
+        self.sslctx = None
 
     ############### Helper functions ###############
 
@@ -54,103 +171,229 @@ class WebRTCSimpleServer(object):
             return http.HTTPStatus.OK, [], b"OK\n"
         return None
 
-    async def recv_msg_ping(self, ws, raddr):
+    def spawn(self, coro):
+        task = asyncio.ensure_future(coro)
+        self.tasks.add(task)
+        task.add_done_callback(self.tasks.discard)
+        return task
+
+    async def peer_writer(self, uid, ws, queue, compact):
         '''
-        Wait for a message forever, and send a regular ping to prevent bad routers
-        from closing the connection.
+        Send queued messages to a peer in order. Each peer has its own writer, so
+        a slow peer only ever delays messages addressed to itself.
         '''
-        msg = None
-        while msg is None:
+        while True:
+            msg = await queue.get()
             try:
-                msg = await asyncio.wait_for(ws.recv(), self.keepalive_timeout)
-            except (asyncio.TimeoutError, concurrent.futures._base.TimeoutError):
-                print('Sending keepalive ping to {!r} in recv'.format(raddr))
-                await ws.ping()
-        return msg
+                if msg is None:
+                    await ws.close()
+                    return
+                if isinstance(msg, bytes) and not compact:
+                    msg = envelope_to_text(msg)
+                await ws.send(msg)
+            except websockets.ConnectionClosed:
+                return
+
+    def open_outbox(self, uid, ws, compact):
+        queue = asyncio.Queue(maxsize=self.max_send_queue)
+        writer = self.spawn(self.peer_writer(uid, ws, queue, compact))
+        self.outboxes[uid] = (ws, queue, writer)
+
+    def close_outbox(self, uid, ws):
+        if uid in self.outboxes and self.outboxes[uid][0] is ws:
+            _, _, writer = self.outboxes.pop(uid)
+            writer.cancel()
+
+    def queue_msg(self, uid, msg):
+        '''
+        Queue @msg for sending to peer @uid without waiting for it to be sent.
+        A peer that lets its queue fill up is too slow to keep up, and is
+        disconnected instead of stalling everyone else. A @msg of None closes
+        the connection once everything queued before it has been sent.
+        '''
+        if uid not in self.outboxes:
+            return False
+        _, queue, _ = self.outboxes[uid]
+        try:
+            queue.put_nowait(msg)
+        except asyncio.QueueFull:
+            self.evict_peer(uid)
+            return False
+        return True
+
+    def evict_peer(self, uid):
+        ws = self.outboxes[uid][0]
+        if not ws.open:
+            return
+        print('Peer {!r} has {} unsent messages, disconnecting slow consumer'
+              ''.format(uid, self.max_send_queue))
+        self.spawn(ws.close(code=1008, reason='slow consumer'))
+
+    def deliver_local(self, uids, msg):
+        for uid in uids:
+            self.queue_msg(uid, msg)
+
+    async def send_to(self, uid, msg):
+        '''
+        Send @msg to peer @uid, which may be connected to another server
+        '''
+        if uid in self.peers:
+            self.queue_msg(uid, msg)
+        else:
+            await self.broker.deliver(uid, msg)
+
+    async def peer_exists(self, uid):
+        return uid in self.peers or await self.broker.lookup(uid)
+
+    async def broadcast_room(self, room_id, uid, msg):
+        '''
+        Queue @msg for every peer in the room except @uid. Nothing here waits on
+        the network, so join/leave cost does not depend on how fast peers read.
+        '''
+        print('room {}: {} -> room: {}'.format(room_id, uid, msg))
+        await self.broker.room_broadcast(room_id, uid, msg)
+
+    def join_session(self, uid, other_id):
+        if uid not in self.peers:
+            return
+        self.peers[uid][2] = 'session'
+        self.sessions[uid] = other_id
+
+    async def end_session(self, uid):
+        '''
+        The session partner of our peer @uid went away
+        '''
+        if uid in self.sessions:
+            del self.sessions[uid]
+            print("Also cleaned up {} session".format(uid))
+            # If there was a session with this peer, also
+            # close the connection to reset its state.
+            if uid in self.peers:
+                print("Closing connection to {}".format(uid))
+                del self.peers[uid]
+                await self.broker.unregister(uid)
+                # Flush whatever is still queued for it before closing
+                self.queue_msg(uid, None)
 
     async def cleanup_session(self, uid):
         if uid in self.sessions:
             other_id = self.sessions[uid]
             del self.sessions[uid]
             print("Cleaned up {} session".format(uid))
-            if other_id in self.sessions:
-                del self.sessions[other_id]
-                print("Also cleaned up {} session".format(other_id))
-                # If there was a session with this peer, also
-                # close the connection to reset its state.
-                if other_id in self.peers:
-                    print("Closing connection to {}".format(other_id))
-                    wso, oaddr, _ = self.peers[other_id]
-                    del self.peers[other_id]
-                    await wso.close()
+            if other_id in self.peers:
+                await self.end_session(other_id)
+            else:
+                await self.broker.end_session(other_id)
 
     async def cleanup_room(self, uid, room_id):
-        room_peers = self.rooms[room_id]
-        if uid not in room_peers:
+        if not await self.broker.room_leave(room_id, uid):
             return
-        room_peers.remove(uid)
-        for pid in room_peers:
-            wsp, paddr, _ = self.peers[pid]
-            msg = 'ROOM_PEER_LEFT {}'.format(uid)
-            print('room {}: {} -> {}: {}'.format(room_id, uid, pid, msg))
-            await wsp.send(msg)
-
-    async def remove_peer(self, uid):
+        await self.broadcast_room(room_id, uid, 'ROOM_PEER_LEFT {}'.format(uid))
+
+    async def remove_peer(self, uid, ws):
         await self.cleanup_session(uid)
-        if uid in self.peers:
+        if uid in self.peers and self.peers[uid][0] is ws:
             ws, raddr, status = self.peers[uid]
             if status and status != 'session':
                 await self.cleanup_room(uid, status)
             del self.peers[uid]
+            await self.broker.unregister(uid)
             await ws.close()
             print("Disconnected from peer {!r} at {!r}".format(uid, raddr))
+        # A peer whose session partner went away was already dropped from
+        # self.peers, but its outbox lives until its connection is gone
+        self.close_outbox(uid, ws)
+        self.heartbeat.remove(uid, ws)
 
     ############### Handler functions ###############
 
-    async def connection_handler(self, ws, uid):
+    async def relay_envelope(self, uid, peer_status, frame):
+        '''
+        Route a binary message from a peer that negotiated compact framing
+        '''
+        try:
+            kind, other_id, payload = unpack_envelope(frame)
+        except ValueError:
+            kind = None
+        if kind == ENVELOPE_RELAY and peer_status == 'session':
+            other_id = self.sessions[uid]
+            print('{} -> {}: {} bytes'.format(uid, other_id, len(payload)))
+            await self.send_to(other_id, frame)
+        elif kind == ENVELOPE_ROOM_PEER_MSG and peer_status not in (None, 'session'):
+            # Room peers exist, so only a failed check costs the lookup
+            if not await self.broker.room_has(peer_status, other_id):
+                if not await self.peer_exists(other_id):
+                    self.queue_msg(uid, 'ERROR peer {!r} not found'.format(other_id))
+                else:
+                    self.queue_msg(uid, 'ERROR peer {!r} is not in the room'.format(other_id))
+            else:
+                print('room {}: {} -> {}: {} bytes'.format(peer_status, uid, other_id, len(payload)))
+                # The recipient sees who the message is from
+                await self.send_to(other_id, pack_envelope(kind, uid, payload))
+        else:
+            self.queue_msg(uid, 'ERROR invalid binary msg')
+
+    async def connection_handler(self, ws, uid, compact):
         raddr = ws.remote_address
         peer_status = None
         self.peers[uid] = [ws, raddr, peer_status]
+        self.open_outbox(uid, ws, compact)
+        self.heartbeat.add(uid, ws)
         print("Registered peer {!r} at {!r}".format(uid, raddr))
         while True:
-            # Receive command, wait forever if necessary
-            msg = await self.recv_msg_ping(ws, raddr)
+            # Receive command, wait forever if necessary. Keepalive pings are
+            # sent by the heartbeat when we've been waiting for too long.
+            msg = await ws.recv()
+            self.heartbeat.touch(uid)
+            # Our session was ended and we were dropped, the close is queued
+            # behind what's left in the outbox. Ignore the peer until it goes
+            # out, breaking here would cancel the writer before it's flushed.
+            if self.peers.get(uid, [None])[0] is not ws:
+                continue
             # Update current status
             peer_status = self.peers[uid][2]
+            if isinstance(msg, bytes):
+                if compact:
+                    await self.relay_envelope(uid, peer_status, msg)
+                else:
+                    self.queue_msg(uid, 'ERROR binary msg without compact framing')
+                continue
             # We are in a session or a room, messages must be relayed
             if peer_status is not None:
                 # We're in a session, route message to connected peer
                 if peer_status == 'session':
                     other_id = self.sessions[uid]
-                    wso, oaddr, status = self.peers[other_id]
-                    assert(status == 'session')
+                    if other_id in self.peers:
+                        wso, oaddr, status = self.peers[other_id]
+                        assert(status == 'session')
                     print("{} -> {}: {}".format(uid, other_id, msg))
-                    await wso.send(msg)
+                    await self.send_to(other_id, msg)
                 # We're in a room, accept room-specific commands
                 elif peer_status:
                     # ROOM_PEER_MSG peer_id MSG
                     if msg.startswith('ROOM_PEER_MSG'):
                         _, other_id, msg = msg.split(maxsplit=2)
-                        if other_id not in self.peers:
-                            await ws.send('ERROR peer {!r} not found'
-                                          ''.format(other_id))
-                            continue
-                        wso, oaddr, status = self.peers[other_id]
-                        if status != room_id:
-                            await ws.send('ERROR peer {!r} is not in the room'
-                                          ''.format(other_id))
+                        # Checked in this order so that relaying to a room
+                        # peer is answered locally, see HubBroker.room_members
+                        if not await self.broker.room_has(peer_status, other_id):
+                            if not await self.peer_exists(other_id):
+                                self.queue_msg(uid, 'ERROR peer {!r} not found'
+                                               ''.format(other_id))
+                            else:
+                                self.queue_msg(uid, 'ERROR peer {!r} is not in the room'
+                                               ''.format(other_id))
                             continue
                         msg = 'ROOM_PEER_MSG {} {}'.format(uid, msg)
-                        print('room {}: {} -> {}: {}'.format(room_id, uid, other_id, msg))
-                        await wso.send(msg)
+                        print('room {}: {} -> {}: {}'.format(peer_status, uid, other_id, msg))
+                        await self.send_to(other_id, msg)
                     elif msg == 'ROOM_PEER_LIST':
-                        room_id = self.peers[peer_id][2]
-                        room_peers = ' '.join([pid for pid in self.rooms[room_id] if pid != peer_id])
+                        room_peers = await self.broker.room_peers(peer_status)
+                        room_peers = ' '.join([pid for pid in room_peers if pid != uid])
                         msg = 'ROOM_PEER_LIST {}'.format(room_peers)
-                        print('room {}: -> {}: {}'.format(room_id, uid, msg))
-                        await ws.send(msg)
+                        print('room {}: -> {}: {}'.format(peer_status, uid, msg))
+                        self.queue_msg(uid, msg)
                     else:
-                        await ws.send('ERROR invalid msg, already in room')
+                        self.queue_msg(uid, 'ERROR invalid msg, already in room')
                         continue
                 else:
                     raise AssertionError('Unknown peer status {!r}'.format(peer_status))
@@ -158,67 +401,70 @@ class WebRTCSimpleServer(object):
             elif msg.startswith('SESSION'):
                 print("{!r} command {!r}".format(uid, msg))
                 _, callee_id = msg.split(maxsplit=1)
-                if callee_id not in self.peers:
-                    await ws.send('ERROR peer {!r} not found'.format(callee_id))
+                if not await self.peer_exists(callee_id):
+                    self.queue_msg(uid, 'ERROR peer {!r} not found'.format(callee_id))
                     continue
                 if peer_status is not None:
-                    await ws.send('ERROR peer {!r} busy'.format(callee_id))
+                    self.queue_msg(uid, 'ERROR peer {!r} busy'.format(callee_id))
                     continue
-                await ws.send('SESSION_OK')
-                wsc = self.peers[callee_id][0]
-                print('Session from {!r} ({!r}) to {!r} ({!r})'
-                      ''.format(uid, raddr, callee_id, wsc.remote_address))
+                self.queue_msg(uid, 'SESSION_OK')
+                print('Session from {!r} ({!r}) to {!r}'.format(uid, raddr, callee_id))
                 # Register session
-                self.peers[uid][2] = peer_status = 'session'
-                self.sessions[uid] = callee_id
-                self.peers[callee_id][2] = 'session'
-                self.sessions[callee_id] = uid
+                self.join_session(uid, callee_id)
+                peer_status = 'session'
+                if callee_id in self.peers:
+                    self.join_session(callee_id, uid)
+                else:
+                    await self.broker.join_session(callee_id, uid)
             # Requested joining or creation of a room
             elif msg.startswith('ROOM'):
                 print('{!r} command {!r}'.format(uid, msg))
                 _, room_id = msg.split(maxsplit=1)
                 # Room name cannot be 'session', empty, or contain whitespace
                 if room_id == 'session' or room_id.split() != [room_id]:
-                    await ws.send('ERROR invalid room id {!r}'.format(room_id))
+                    self.queue_msg(uid, 'ERROR invalid room id {!r}'.format(room_id))
                     continue
-                if room_id in self.rooms:
-                    if uid in self.rooms[room_id]:
-                        raise AssertionError('How did we accept a ROOM command '
-                                             'despite already being in a room?')
-                else:
-                    # Create room if required
-                    self.rooms[room_id] = set()
-                room_peers = ' '.join([pid for pid in self.rooms[room_id]])
-                await ws.send('ROOM_OK {}'.format(room_peers))
-                # Enter room
+                # Enter room, creating it if required
+                room_peers = await self.broker.room_join(room_id, uid)
+                if room_peers is None:
+                    raise AssertionError('How did we accept a ROOM command '
+                                         'despite already being in a room?')
+                self.queue_msg(uid, 'ROOM_OK {}'.format(' '.join(room_peers)))
                 self.peers[uid][2] = peer_status = room_id
-                self.rooms[room_id].add(uid)
-                for pid in self.rooms[room_id]:
-                    if pid == uid:
-                        continue
-                    wsp, paddr, _ = self.peers[pid]
-                    msg = 'ROOM_PEER_JOINED {}'.format(uid)
-                    print('room {}: {} -> {}: {}'.format(room_id, uid, pid, msg))
-                    await wsp.send(msg)
+                await self.broadcast_room(room_id, uid, 'ROOM_PEER_JOINED {}'.format(uid))
             else:
                 print('Ignoring unknown message {!r} from {!r}'.format(msg, uid))
 
     async def hello_peer(self, ws):
         '''
-        Exchange hello, register peer
+        Exchange hello, register peer. Returns the uid, and whether the peer
+        asked for compact framing.
         '''
         raddr = ws.remote_address
-        hello = await ws.recv()
-        hello, uid = hello.split(maxsplit=1)
-        if hello != 'HELLO':
+        # Not known to the heartbeat yet, so a connection that never says
+        # hello must not be waited on forever
+        try:
+            hello = await asyncio.wait_for(ws.recv(), self.keepalive_timeout)
+        except asyncio.TimeoutError:
+            await ws.close(code=1008, reason='hello timeout')
+            raise Exception("No hello from {!r} in {}s".format(raddr, self.keepalive_timeout))
+        # 'HELLO <uid> [feature ...]', the uid can't have whitespace in it
+        tokens = hello.split() if isinstance(hello, str) else []
+        if len(tokens) < 2 or tokens[0] != 'HELLO':
             await ws.close(code=1002, reason='invalid protocol')
             raise Exception("Invalid hello from {!r}".format(raddr))
-        if not uid or uid in self.peers or uid.split() != [uid]:  # no whitespace
+        hello, uid, *features = tokens
+        compact = 'compact' in features
+        if not await self.broker.register(uid):
             await ws.close(code=1002, reason='invalid peer uid')
             raise Exception("Invalid uid {!r} from {!r}".format(uid, raddr))
-        # Send back a HELLO
-        await ws.send('HELLO')
-        return uid
+        # Send back a HELLO, with the features we accepted
+        try:
+            await ws.send('HELLO compact' if compact else 'HELLO')
+        except websockets.ConnectionClosed:
+            await self.broker.unregister(uid)
+            raise
+        return uid, compact
 
     def get_ssl_certs(self):
         if 'letsencrypt' in self.cert_path:
@@ -246,6 +492,23 @@ class WebRTCSimpleServer(object):
         sslctx.verify_mode = ssl.CERT_NONE
         return sslctx
 
+    def reload_ssl_ctx(self):
+        '''
+        Load the new certificate into the context the server is already using.
+        Only handshakes started after this use it, established connections are
+        left alone.
+        '''
+        chain_pem, key_pem = self.get_ssl_certs()
+        try:
+            # Try it out on a scratch context first: a half-written cert or a
+            # cert/key mismatch must not break the live context
+            ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER).load_cert_chain(chain_pem, keyfile=key_pem)
+            self.sslctx.load_cert_chain(chain_pem, keyfile=key_pem)
+        except (OSError, ssl.SSLError) as e:
+            print('Failed to load new certificate, keeping the old one: {}'.format(e))
+            return False
+        return True
+
     async def run(self):
         async def handler(ws, path):
             '''
@@ -253,19 +516,27 @@ class WebRTCSimpleServer(object):
             '''
             raddr = ws.remote_address
             print("Connected to {!r}".format(raddr))
-            peer_id = await self.hello_peer(ws)
+            peer_id = None
             try:
-                await self.connection_handler(ws, peer_id)
+                peer_id, compact = await self.hello_peer(ws)
+                await self.connection_handler(ws, peer_id, compact)
             except websockets.ConnectionClosed:
                 print("Connection to peer {!r} closed, exiting handler".format(raddr))
             finally:
-                await self.remove_peer(peer_id)
+                if peer_id is not None:
+                    await self.remove_peer(peer_id, ws)
 
-        sslctx = self.get_ssl_ctx()
+        self.sslctx = sslctx = self.get_ssl_ctx()
 
         print("Listening on https://{}:{}".format(self.addr, self.port))
         # Websocket server
         wsd = websockets.serve(handler, self.addr, self.port, ssl=sslctx, process_request=self.health_check if self.health_path else None,
+                               # Let several worker processes accept on the same port
+                               reuse_port=self.reuse_port,
+                               # Keepalive is done by our heartbeat, not a task per connection
+                               ping_interval=None,
+                               # permessage-deflate, offered to clients that ask for it
+                               compression=None if self.disable_deflate else 'deflate',
                                # Maximum number of messages that websockets will pop
                                # off the asyncio and OS buffers per connection. See:
                                # https://websockets.readthedocs.io/en/stable/api.html#websockets.protocol.WebSocketCommonProtocol
@@ -278,7 +549,10 @@ class WebRTCSimpleServer(object):
 
         try:
             self.exit_future = asyncio.Future()
-            task = asyncio.create_task(self.check_server_needs_restart())
+            await self.broker.start(self)
+            self.heartbeat = Heartbeat(self.keepalive_timeout, self.spawn)
+            heartbeat_task = asyncio.create_task(self.heartbeat.run())
+            task = asyncio.create_task(self.watch_cert())
 
             # Run the server
             async with wsd:
@@ -287,9 +561,10 @@ class WebRTCSimpleServer(object):
             print('Stopped.')
         finally:
             logger.removeHandler(handler)
+            await self.broker.stop()
             self.peers = dict()
             self.sessions = dict()
-            self.rooms = dict()
+            self.outboxes = dict()
 
     def stop(self):
         if self.exit_future:
@@ -298,7 +573,11 @@ class WebRTCSimpleServer(object):
 
     def check_cert_changed(self):
         chain_pem, key_pem = self.get_ssl_certs()
-        mtime = max(os.stat(key_pem).st_mtime, os.stat(chain_pem).st_mtime)
+        try:
+            mtime = max(os.stat(key_pem).st_mtime, os.stat(chain_pem).st_mtime)
+        except OSError:
+            # Probably being replaced right now, look again next time
+            return False
         if self.cert_mtime < 0:
             self.cert_mtime = mtime
             return False
@@ -307,16 +586,17 @@ class WebRTCSimpleServer(object):
             return True
         return False
 
-    async def check_server_needs_restart(self):
-        "When the certificate changes, we need to restart the server"
-        if not self.cert_restart:
+    async def watch_cert(self):
+        "When the certificate changes, use it for new connections"
+        if not self.cert_reload or not self.sslctx:
             return
+        self.check_cert_changed()
         while True:
             await asyncio.sleep(10)
             if self.check_cert_changed():
-                print('Certificate changed, stopping server...')
-                self.stop()
-                return
+                print('Certificate changed, reloading...')
+                if self.reload_ssl_ctx():
+                    print('Reloaded certificate, {} peers stay connected'.format(len(self.peers)))
 
 
 def main():
@@ -328,10 +608,34 @@ def main():
     parser.add_argument('--cert-path', default=os.path.dirname(__file__))
     parser.add_argument('--disable-ssl', default=False, help='Disable ssl', action='store_true')
     parser.add_argument('--health', default='/health', help='Health check route')
-    parser.add_argument('--restart-on-cert-change', default=False, dest='cert_restart', action='store_true', help='Automatically restart if the SSL certificate changes')
+    parser.add_argument('--disable-deflate', default=False, action='store_true', help='Do not offer permessage-deflate compression to clients')
+    parser.add_argument('--max-send-queue', dest='max_send_queue', default=128, type=int, help='Messages queued for a peer before it is disconnected as a slow consumer')
+    parser.add_argument('--reload-on-cert-change', '--restart-on-cert-change', default=False, dest='cert_reload', action='store_true', help='Use the new SSL certificate for new connections when it changes, without dropping existing ones')
+    parser.add_argument('--broker', default='local', help='Where peers and rooms are shared between servers: local, uds:<path> or tcp:<host>:<port>')
+    parser.add_argument('--workers', default=1, type=int, help='Number of server processes sharing the port, with a broker hub in the parent process')
+    parser.add_argument('--hub', default=False, action='store_true', help='Only run a broker hub on the --broker address, for servers on other hosts')
 
     options = parser.parse_args(sys.argv[1:])
 
+    if options.workers > 1 and options.broker == 'local':
+        sock = 'webrtc-signalling-{}.sock'.format(options.port)
+        options.broker = 'uds:' + os.path.join(tempfile.gettempdir(), sock)
+
+    if options.hub:
+        asyncio.run(BrokerHub(options.broker).serve())
+        return
+
+    if options.workers > 1:
+        print('Starting {} workers...'.format(options.workers))
+        for _ in range(options.workers):
+            multiprocessing.Process(target=serve_forever, args=(options,), daemon=True).start()
+        asyncio.run(BrokerHub(options.broker).serve())
+        return
+
+    serve_forever(options)
+
+
+def serve_forever(options):
     print('Starting server...')
     while True:
         r = WebRTCSimpleServer(options)